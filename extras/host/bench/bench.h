@@ -0,0 +1,51 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+// Iterations to run: n, or n / 100 with --quick (as run by ctest)
+inline long benchIterations(int argc, char** argv, long n)
+{
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            return n / 100 ? n / 100 : 1;
+        }
+    }
+    return n;
+}
+
+// Wall clock nanoseconds per call of f, over n calls
+template<class F>
+double benchNs(F f, long n)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (long i = 0; i < n; i++) {
+        f();
+    }
+    std::chrono::duration<double, std::nano> t = std::chrono::steady_clock::now() - start;
+    return t.count() / n;
+}
+
+inline void benchReport(const char* name, double ns)
+{
+    printf("%-32s %12.1f ns\n", name, ns);
+}
@@ -0,0 +1,118 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Bytes per second of ResponseMatcher against the String::endsWith() chain
+// waitResponse() used before it, on the same module traffic
+
+#include <MKRWAN.h>
+#include "bench.h"
+#include <random>
+#include <string>
+#include <vector>
+
+struct Match
+{
+    size_t  pos;
+    int8_t  index;
+    bool operator==(const Match& m) const { return pos == m.pos && index == m.index; }
+};
+
+// The former loop: append to a String, test each candidate, then +RECV=
+static std::vector<Match> endsWithChain(const std::string& in, const ConstStr* keys, int count)
+{
+    std::vector<Match> found;
+    String data;
+    data.reserve(64);
+    for (size_t i = 0; i < in.size(); i++) {
+        data += in[i];
+        int8_t index = 0;
+        for (int k = 0; k < count && !index; k++) {
+            if (data.endsWith(keys[k])) {
+                index = k + 1;
+            }
+        }
+        if (!index && data.endsWith("+RECV=")) {
+            index = LORA_RECV_INDEX;
+        }
+        if (index) {
+            Match m = { i, index };
+            found.push_back(m);
+            data = "";
+        }
+    }
+    return found;
+}
+
+static std::vector<Match> automaton(const std::string& in, const ConstStr* keys, int count)
+{
+    std::vector<Match> found;
+    ResponseMatcher matcher;
+    for (int k = 0; k < count; k++) {
+        matcher.add(keys[k], k + 1);
+    }
+    matcher.add(LORA_RECV, LORA_RECV_INDEX);
+    matcher.compile();
+    for (size_t i = 0; i < in.size(); i++) {
+        int8_t index = matcher.feed(in[i]);
+        if (index) {
+            Match m = { i, index };
+            found.push_back(m);
+            matcher.reset();
+        }
+    }
+    return found;
+}
+
+// Module output: replies, events, downlink headers and values
+static std::string traffic(size_t size)
+{
+    static const char* const lines[] = {
+        "+OK\r", "+OK=869525000\r", "+OK=00ff00000000000000000000\r", "+ERR\r", "+ERR_PARAM\r",
+        "+ERR_BUSY\r", "+ERR_PARAM_OVERFLOW\r", "+ERR_NO_NETWORK\r", "+ERR_RX\r", "+ERR_UNKNOWN\r",
+        "+EVENT=1,1\r", "+EVENT=0,0\r", "+RECV=", "3,4\r\n\r\nabcd", "+OK=ARD-078\r",
+    };
+    std::mt19937 rng(1);
+    std::string s;
+    while (s.size() < size) {
+        s += lines[rng() % (sizeof(lines) / sizeof(lines[0]))];
+    }
+    return s;
+}
+
+int main(int argc, char** argv)
+{
+    long n = benchIterations(argc, argv, 50);
+    std::string in = traffic(1 << 20);
+    const ConstStr keys[8] = { LORA_OK, LORA_ERROR, LORA_ERROR_PARAM, LORA_ERROR_BUSY,
+                               LORA_ERROR_OVERFLOW, LORA_ERROR_NO_NETWORK, LORA_ERROR_RX, LORA_ERROR_UNKNOWN };
+    int failed = 0;
+    for (int count = 2; count <= 8; count += 6) {
+        std::vector<Match> a = endsWithChain(in, keys, count);
+        std::vector<Match> b = automaton(in, keys, count);
+        if (a != b) {
+            printf("%d candidates: the matchers disagree\n", count);
+            failed++;
+        }
+        double chain = benchNs([&] { endsWithChain(in, keys, count); }, n);
+        double dfa = benchNs([&] { automaton(in, keys, count); }, n);
+        printf("%d candidates + RECV, %zu matches\n", count, a.size());
+        printf("  %-30s %8.1f MB/s\n", "String::endsWith chain", in.size() / chain * 1e3);
+        printf("  %-30s %8.1f MB/s\n", "ResponseMatcher", in.size() / dfa * 1e3);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,113 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The numeric getters, parsing the reply as it is read, against the String
+// path they replaced: the reply read into a String, then toInt() or sscanf().
+// Both go through the same command and response matching, so the difference
+// is the parsing. getNwkSKey() stands in for the String read, its reply is
+// set to the number.
+
+#include <MKRWAN.h>
+#include "bench.h"
+#include <string>
+
+// Answers each command line with the same reply, instantly
+class FixedReply : public Stream
+{
+public:
+    FixedReply() : _pos(0), _armed(false) {}
+
+    void set(const std::string& reply)
+    {
+        _reply = reply;
+    }
+
+    int available()
+    {
+        return _armed ? _reply.size() - _pos : 0;
+    }
+
+    int read()
+    {
+        if (!available()) {
+            return -1;
+        }
+        int c = (uint8_t)_reply[_pos++];
+        _armed = _pos < _reply.size();
+        return c;
+    }
+
+    int peek()
+    {
+        return available() ? (uint8_t)_reply[_pos] : -1;
+    }
+
+    size_t write(uint8_t c)
+    {
+        if (c == '\r') {
+            _pos = 0;
+            _armed = true;
+        }
+        return 1;
+    }
+    using Print::write;
+
+private:
+    std::string _reply;
+    size_t      _pos;
+    bool        _armed;
+};
+
+int main(int argc, char** argv)
+{
+    long n = benchIterations(argc, argv, 200000);
+    FixedReply io;
+    LoRaModem modem(io);
+    int failed = 0;
+
+    io.set("+OK=869525000\r");
+    uint32_t freq = 0;
+    benchReport("getRX2Freq, streaming", benchNs([&] {
+        modem.invalidateCache();
+        freq = modem.getRX2Freq();
+    }, n));
+    long ref = 0;
+    benchReport("getRX2Freq, String toInt()", benchNs([&] {
+        ref = modem.getNwkSKey().toInt();
+    }, n));
+    failed += freq != 869525000UL || ref != (long)freq;
+
+    io.set("+OK=00ff000000000000000000ff\r");
+    uint16_t mask[6] = { 0 };
+    benchReport("getChannelMask, streaming", benchNs([&] {
+        modem.invalidateCache();
+        modem.getChannelMask(mask);
+    }, n));
+    uint16_t words[6] = { 0 };
+    benchReport("getChannelMask, String sscanf", benchNs([&] {
+        String s = modem.getNwkSKey();
+        sscanf(s.c_str(), "%04hx%04hx%04hx%04hx%04hx%04hx",
+               &words[0], &words[1], &words[2], &words[3], &words[4], &words[5]);
+    }, n));
+    failed += mask[0] != 0x00ff || mask[5] != 0x00ff || memcmp(mask, words, sizeof(mask)) != 0;
+
+    if (failed) {
+        printf("the streaming parsers disagree with toInt() / sscanf()\n");
+    }
+    return failed ? 1 : 0;
+}
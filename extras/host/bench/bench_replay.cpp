@@ -0,0 +1,99 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Records a session with the simulated module (built with LORA_TRACE), then
+// replays the trace through LoRaTraceReplay as fast as the library reads it:
+// what the library writes must match the recording byte for byte.
+
+#include <MKRWAN.h>
+#include "SimModem.h"
+#include "bench.h"
+#include <string>
+
+// Collects a dumpTrace()
+class TraceBuffer : public Print
+{
+public:
+    size_t write(uint8_t c)
+    {
+        data += (char)c;
+        return 1;
+    }
+    using Print::write;
+
+    std::string data;
+};
+
+// The calls of the session; sim is NULL when the module is a replay
+static int session(LoRaModem& modem, SimModem* sim)
+{
+    int failed = 0;
+    failed += !modem.begin(EU868);
+    failed += !modem.joinOTAA("0000000000000001", "00112233445566778899aabbccddeeff");
+    failed += modem.getDataRate() != 5;
+    failed += modem.getRX2Freq() != 869525000UL;
+    for (int i = 0; i < 4; i++) {
+        modem.beginPacket();
+        modem.write((const uint8_t*)"0123456789ab", 12);
+        failed += modem.endPacket(i & 1) != 12;
+    }
+    if (sim) {
+        sim->downlink(3, "downlink");
+    }
+    uint8_t buf[16];
+    uint8_t port = 0;
+    failed += modem.readMessage(buf, sizeof(buf), &port) != 8 || port != 3;
+    return failed;
+}
+
+int main(int argc, char** argv)
+{
+    long n = benchIterations(argc, argv, 20000);
+    int failed = 0;
+
+    TraceBuffer trace;
+    {
+        SimModem sim;
+        LoRaModem modem(sim);
+        failed += session(modem, &sim);
+        modem.dumpTrace(trace);
+    }
+    size_t records = 0;
+    LoRaTraceReader reader((const uint8_t*)trace.data.data(), trace.data.size());
+    while (reader.next()) {
+        records++;
+    }
+    printf("trace: %u bytes, %u records\n", (unsigned)trace.data.size(), (unsigned)records);
+    // the oldest records were dropped if it filled the recorder
+    failed += trace.data.size() + 64 > LORA_TRACE_BUFFER;
+
+    LoRaTraceReplay replay((const uint8_t*)trace.data.data(), trace.data.size());
+    double ns = benchNs([&] {
+        replay.rewind();
+        LoRaModem modem(replay);
+        failed += session(modem, NULL);
+        failed += replay.mismatches() != 0 || !replay.done();
+    }, n);
+    benchReport("replay session", ns);
+    printf("%-32s %12.1f MB/s\n", "replay throughput", trace.data.size() / ns * 1000);
+
+    if (failed) {
+        printf("the replay diverged from the recorded session\n");
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,58 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// CPU time of the library for a join, an uplink and a downlink, against a
+// module answering instantly so that only the host side is measured
+
+#include <MKRWAN.h>
+#include "SimModem.h"
+#include "bench.h"
+
+int main(int argc, char** argv)
+{
+    long n = benchIterations(argc, argv, 20000);
+    SimModem sim;
+    sim.latency_us = 0;
+    sim.join_ms = 0;
+    LoRaModem modem(sim);
+    if (!modem.begin(EU868)) {
+        return 1;
+    }
+    int failed = 0;
+
+    benchReport("joinOTAA", benchNs([&] {
+        failed += !modem.joinOTAA("0000000000000001", "00112233445566778899aabbccddeeff");
+    }, n / 10));
+
+    benchReport("endPacket 12 bytes", benchNs([&] {
+        modem.beginPacket();
+        modem.write((const uint8_t*)"0123456789ab", 12);
+        failed += modem.endPacket() != 12;
+    }, n));
+
+    sim.log.clear();
+    sim.payloads.clear();
+    uint8_t buf[64];
+    std::string payload(32, 'd');
+    benchReport("downlink 32 bytes", benchNs([&] {
+        sim.downlink(3, payload);
+        failed += modem.readMessage(buf, sizeof(buf)) != 32;
+    }, n));
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,131 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+
+HardwareSerial Serial;
+
+static uint64_t now_us = 0;
+
+uint64_t hostMicros()
+{
+    return now_us;
+}
+
+void hostAdvance(uint64_t us)
+{
+    now_us += us;
+}
+
+unsigned long millis()
+{
+    now_us++;
+    return (unsigned long)(uint32_t)(now_us / 1000);
+}
+
+unsigned long micros()
+{
+    now_us++;
+    return (unsigned long)(uint32_t)now_us;
+}
+
+void delay(unsigned long ms)
+{
+    now_us += (uint64_t)ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    now_us += us;
+}
+
+// a pass of the scheduler
+void yield()
+{
+    now_us += 10;
+}
+
+String::String(long v)
+{
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%ld", v);
+    _s = buf;
+}
+
+size_t Print::print(long v, int base)
+{
+    if (base == DEC) {
+        char buf[24];
+        snprintf(buf, sizeof(buf), "%ld", v);
+        return write(buf);
+    }
+    return print((unsigned long)v, base);
+}
+
+size_t Print::print(unsigned long v, int base)
+{
+    char buf[40];
+    char* p = &buf[sizeof(buf) - 1];
+    *p = '\0';
+    if (base < 2) base = DEC;
+    do {
+        int d = v % base;
+        *--p = d < 10 ? '0' + d : 'A' + d - 10;
+        v /= base;
+    } while (v);
+    return write(p);
+}
+
+size_t Print::print(double v, int digits)
+{
+    char buf[48];
+    snprintf(buf, sizeof(buf), "%.*f", digits, v);
+    return write(buf);
+}
+
+int Stream::timedRead()
+{
+    unsigned long start = millis();
+    do {
+        int c = read();
+        if (c >= 0) return c;
+    } while (millis() - start < _timeout);
+    return -1;
+}
+
+size_t Stream::readBytes(uint8_t* buffer, size_t length)
+{
+    size_t n = 0;
+    while (n < length) {
+        int c = timedRead();
+        if (c < 0) break;
+        buffer[n++] = (uint8_t)c;
+    }
+    return n;
+}
+
+String Stream::readStringUntil(char terminator)
+{
+    String s;
+    int c = timedRead();
+    while (c >= 0 && c != terminator) {
+        s += (char)c;
+        c = timedRead();
+    }
+    return s;
+}
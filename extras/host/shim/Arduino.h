@@ -0,0 +1,157 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/*
+ * The part of the Arduino core MKRWAN.h uses, for a host build.
+ *
+ * Time is simulated: delay() and yield() move the clock forward instead of
+ * sleeping, so a test waiting 60 s for a join runs in a few milliseconds.
+ * Every millis() or micros() call also advances it by 1 us, so that loops
+ * polling the clock always make progress, as they would on a board.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#define DEC 10
+#define HEX 16
+
+#define SERIAL_8N1 0x06
+#define SERIAL_8N2 0x0E
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+// Simulated time since start, in microseconds
+uint64_t hostMicros();
+void hostAdvance(uint64_t us);
+
+/*
+ * Heap backed like the real one: each String that grows allocates.
+ */
+class String
+{
+public:
+    String(const char* s = "") : _s(s ? s : "") {}
+    String(const std::string& s) : _s(s) {}
+    String(char c) : _s(1, c) {}
+    String(long v);
+
+    const char* c_str() const { return _s.c_str(); }
+    unsigned int length() const { return _s.size(); }
+    void reserve(unsigned int size) { _s.reserve(size); }
+    long toInt() const { return strtol(_s.c_str(), NULL, 10); }
+    bool endsWith(const String& suffix) const
+    {
+        return _s.size() >= suffix._s.size() &&
+               _s.compare(_s.size() - suffix._s.size(), suffix._s.size(), suffix._s) == 0;
+    }
+    bool startsWith(const String& prefix) const { return _s.compare(0, prefix._s.size(), prefix._s) == 0; }
+    char operator[](unsigned int i) const { return i < _s.size() ? _s[i] : 0; }
+
+    String& operator+=(char c) { _s += c; return *this; }
+    String& operator+=(const char* s) { _s += s; return *this; }
+    String& operator+=(const String& s) { _s += s._s; return *this; }
+    bool operator==(const String& s) const { return _s == s._s; }
+    bool operator!=(const String& s) const { return _s != s._s; }
+    bool operator==(const char* s) const { return _s == s; }
+
+    friend String operator+(const String& a, const String& b) { return String(a._s + b._s); }
+
+private:
+    std::string _s;
+};
+
+class Print
+{
+public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size)
+    {
+        size_t n = 0;
+        while (size--) {
+            if (!write(*buffer++)) break;
+            n++;
+        }
+        return n;
+    }
+    size_t write(const char* str) { return str ? write((const uint8_t*)str, strlen(str)) : 0; }
+    size_t write(const char* buffer, size_t size) { return write((const uint8_t*)buffer, size); }
+    virtual void flush() {}
+
+    size_t print(const char* s) { return write(s); }
+    size_t print(const String& s) { return write(s.c_str()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char v, int base = DEC) { return print((unsigned long)v, base); }
+    size_t print(int v, int base = DEC) { return print((long)v, base); }
+    size_t print(unsigned int v, int base = DEC) { return print((unsigned long)v, base); }
+    size_t print(long v, int base = DEC);
+    size_t print(unsigned long v, int base = DEC);
+    size_t print(double v, int digits = 2);
+
+    size_t println() { return write("\r\n"); }
+    template<typename T> size_t println(T v) { size_t n = print(v); return n + println(); }
+    template<typename T> size_t println(T v, int f) { size_t n = print(v, f); return n + println(); }
+};
+
+class Stream : public Print
+{
+public:
+    Stream() : _timeout(1000) {}
+
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    void setTimeout(unsigned long timeout) { _timeout = timeout; }
+    size_t readBytes(uint8_t* buffer, size_t length);
+    size_t readBytes(char* buffer, size_t length) { return readBytes((uint8_t*)buffer, length); }
+    String readStringUntil(char terminator);
+
+protected:
+    int timedRead();
+
+    unsigned long _timeout;
+};
+
+// Serial prints to stdout and never receives anything
+class HardwareSerial : public Stream
+{
+public:
+    void begin(unsigned long, uint16_t = SERIAL_8N1) {}
+    void end() {}
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+    size_t write(uint8_t c) { return fputc(c, stdout) == EOF ? 0 : 1; }
+    using Print::write;
+    operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,267 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/*
+ * Stand-in for the ARD-078 module, speaking its AT dialect over a Stream
+ * passed to the LoRaModem constructor:
+ *   AT+<name>=<value>  stores the value, answers +OK
+ *   AT+<name>?         answers +OK=<value>, +ERR_PARAM if never set
+ *   AT+JOIN            +OK, then +EVENT=1,1 (or 1,0) join_ms later
+ *   AT+UTX n, AT+CTX n takes n bytes of payload, then answers the next
+ *                      scripted uplink result, +OK by default
+ *   AT+REBOOT          +OK, then +EVENT=0,0
+ * Downlinks are sent as +RECV=<port>,<len>\r\n\r\n<payload>.
+ *
+ * Replies are timed with the simulated clock of the shim: they become
+ * readable latency_us after the command, then one byte every byte_us.
+ */
+
+#include <Arduino.h>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+class SimModem : public Stream
+{
+public:
+    SimModem() : latency_us(2000), byte_us(0), join_ms(5000), join_accept(true), _payload(0)
+    {
+        params["DEV"] = "ARD-078";
+        params["VER"] = "1.2.1";
+        params["DEVEUI"] = "a8610a3233000001";
+        params["DEVADDR"] = "260b1234";
+        params["DR"] = "5";
+        params["ADR"] = "1";
+        params["RX2DR"] = "0";
+        params["RX2FQ"] = "869525000";
+        params["CHANMASK"] = "00ff00000000000000000000";
+        params["NJS"] = "0";
+        params["FCU"] = "0";
+        params["FCD"] = "0";
+        params["MSIZE"] = "64";
+    }
+
+    // Answers an exact command, without "AT", with a raw response
+    void reply(const std::string& command, const std::string& response)
+    {
+        replies[command] = response;
+    }
+
+    // Queues the answer of a coming uplink, e.g. "+ERR_BUSY\r"
+    void uplinkResult(const std::string& response)
+    {
+        uplink_results.push_back(response);
+    }
+
+    void downlink(uint8_t port, const std::string& payload, uint32_t after_us = 0)
+    {
+        Scope s;
+        char hdr[32];
+        snprintf(hdr, sizeof(hdr), "+RECV=%u,%u\r\n\r\n", port, (unsigned)payload.size());
+        send(hdr + payload, after_us);
+    }
+
+    // Unsolicited bytes, readable after_us from now. They go out ahead of
+    // messages due later, as a whole, like a reply overtaking a pending event.
+    void send(const std::string& data, uint32_t after_us = 0)
+    {
+        Scope s;
+        if (data.empty()) {
+            return;
+        }
+        uint64_t due = hostMicros() + after_us;
+        std::deque<Byte>::iterator at = _out.begin();
+        while (at != _out.end() && !(at->first && at->due > due)) {
+            ++at;
+        }
+        size_t pos = at - _out.begin();
+        for (size_t i = 0; i < data.size(); i++) {
+            Byte b = { due, (uint8_t)data[i], i == 0 };
+            at = _out.insert(at, b) + 1;
+        }
+        // one byte every byte_us, from the previous byte on
+        for (size_t i = pos ? pos : 1; i < _out.size(); i++) {
+            if (_out[i].due < _out[i - 1].due + byte_us) {
+                _out[i].due = _out[i - 1].due + byte_us;
+            }
+        }
+    }
+
+    void clearLog()
+    {
+        log.clear();
+        payloads.clear();
+    }
+
+    // Bytes sent but not read yet, whether readable now or later
+    size_t pending()
+    {
+        return _out.size();
+    }
+
+    int available()
+    {
+        Scope s;
+        uint64_t now = hostMicros();
+        int n = 0;
+        for (std::deque<Byte>::iterator it = _out.begin(); it != _out.end() && it->due <= now; ++it) {
+            n++;
+        }
+        return n;
+    }
+
+    int read()
+    {
+        Scope s;
+        if (_out.empty() || _out.front().due > hostMicros()) {
+            return -1;
+        }
+        int c = _out.front().c;
+        _out.pop_front();
+        return c;
+    }
+
+    int peek()
+    {
+        Scope s;
+        if (_out.empty() || _out.front().due > hostMicros()) {
+            return -1;
+        }
+        return _out.front().c;
+    }
+
+    size_t write(uint8_t c)
+    {
+        Scope s;
+        if (_payload) {
+            _data += (char)c;
+            if (--_payload == 0) {
+                payloads.push_back(_data);
+                answerUplink();
+            }
+            return 1;
+        }
+        if (c != '\r') {
+            _line += (char)c;
+            return 1;
+        }
+        std::string line;
+        line.swap(_line);
+        log.push_back(line);
+        if (line.compare(0, 2, "AT") != 0) {
+            return 1;
+        }
+        command(line.substr(2));
+        return 1;
+    }
+    using Print::write;
+
+    // Allocations made by the simulator itself, to be left out of counts
+    static int& internal()
+    {
+        static int depth = 0;
+        return depth;
+    }
+
+    uint32_t latency_us;  // command to first byte of the reply
+    uint32_t byte_us;     // 573 for 19200 baud 8N2, 0 for instant replies
+    uint32_t join_ms;
+    bool     join_accept;
+    std::map<std::string, std::string> params;
+    std::map<std::string, std::string> replies;
+    std::deque<std::string> uplink_results;
+    std::vector<std::string> log;       // command lines received
+    std::vector<std::string> payloads;  // uplink payloads received
+    // sees each command first, returns true when it answered it
+    std::function<bool(SimModem&, const std::string&)> hook;
+
+private:
+    struct Scope
+    {
+        Scope() { internal()++; }
+        ~Scope() { internal()--; }
+    };
+
+    struct Byte
+    {
+        uint64_t due;
+        uint8_t  c;
+        bool     first;  // of a message
+    };
+
+    void answer(const std::string& data, uint32_t after_us = 0)
+    {
+        send(data, latency_us + after_us);
+    }
+
+    void command(const std::string& cmd)
+    {
+        if (hook && hook(*this, cmd)) {
+            return;
+        }
+        std::map<std::string, std::string>::iterator r = replies.find(cmd);
+        if (r != replies.end()) {
+            answer(r->second);
+            return;
+        }
+        if (cmd.empty()) {
+            answer("+OK\r");
+        } else if (cmd == "+JOIN") {
+            answer("+OK\r");
+            params["NJS"] = join_accept ? "1" : "0";
+            answer(join_accept ? "+EVENT=1,1\r" : "+EVENT=1,0\r", join_ms * 1000);
+        } else if (cmd == "+REBOOT") {
+            answer("+OK\r");
+            answer("+EVENT=0,0\r", 100000);
+        } else if (cmd.compare(0, 5, "+UTX ") == 0 || cmd.compare(0, 5, "+CTX ") == 0) {
+            _data.clear();
+            _payload = atoi(cmd.c_str() + 5);
+            if (!_payload) {
+                answerUplink();
+            }
+        } else if (cmd[cmd.size() - 1] == '?') {
+            std::map<std::string, std::string>::iterator p = params.find(cmd.substr(1, cmd.size() - 2));
+            answer(p != params.end() ? "+OK=" + p->second + "\r" : "+ERR_PARAM\r");
+        } else if (cmd.find('=') != std::string::npos) {
+            size_t eq = cmd.find('=');
+            params[cmd.substr(1, eq - 1)] = cmd.substr(eq + 1);
+            answer("+OK\r");
+        } else {
+            answer("+OK\r");
+        }
+    }
+
+    void answerUplink()
+    {
+        if (uplink_results.empty()) {
+            answer("+OK\r");
+            return;
+        }
+        answer(uplink_results.front());
+        uplink_results.pop_front();
+    }
+
+    std::deque<Byte> _out;
+    std::string _line;
+    std::string _data;
+    size_t      _payload;
+};
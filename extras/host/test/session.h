@@ -0,0 +1,32 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <MKRWAN.h>
+
+// Keys the tests join with, SimModem takes any
+static const char APP_EUI_TEST[] = "0000000000000001";
+static const char APP_KEY_TEST[] = "00112233445566778899aabbccddeeff";
+
+// A modem started on band and joined, as most tests need it
+template<class Modem>
+bool startSession(Modem& modem, _lora_band band = EU868)
+{
+    return modem.begin(band) && modem.joinOTAA(APP_EUI_TEST, APP_KEY_TEST);
+}
@@ -0,0 +1,104 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Counts the heap allocations of the library: none once started, as long as
+// the buffer based variants of the String getters are used
+
+#include <MKRWAN.h>
+#include "SimModem.h"
+#include "check.h"
+#include "session.h"
+#include <new>
+
+static long allocations = 0;
+
+void* operator new(size_t size)
+{
+    if (!SimModem::internal()) {
+        allocations++;
+    }
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+// Not inlined, GCC would take the free() of what operator new returned for
+// a mismatch
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+static void session(LoRaModem& modem, SimModem& sim, const std::string& payload)
+{
+    char buf[LORA_LINE_BUFFER];
+    uint16_t mask[6];
+    // every getter goes to the module
+    modem.invalidateCache();
+    CHECK(modem.getDataRate() == 5);
+    CHECK(modem.getADR() == 1);
+    CHECK(modem.getRX2Freq() == 869525000UL);
+    CHECK(modem.getRX2DR() == 0);
+    CHECK(modem.getFCU() == 0);
+    CHECK(modem.getFCD() == 0);
+    CHECK(modem.getChannelMask(mask) && mask[0] == 0x00ff);
+    CHECK(modem.version(buf, sizeof(buf)) == 13);
+    CHECK(modem.deviceEUI(buf, sizeof(buf)) == 16);
+    CHECK(modem.getDevAddr(buf, sizeof(buf)) == 8);
+    CHECK(modem.dataRate(3));
+    CHECK(modem.setPort(7));
+
+    modem.beginPacket();
+    modem.write((const uint8_t*)"0123456789", 10);
+    CHECK(modem.endPacket(true) == 10);
+
+    sim.downlink(3, payload);
+    uint8_t data[64];
+    uint8_t port = 0;
+    CHECK(modem.readMessage(data, sizeof(data), &port) == (int)payload.size() && port == 3);
+    CHECK(modem.dataRate(5));
+}
+
+int main()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    std::string payload(20, 'p');
+    CHECK(startSession(modem));
+    session(modem, sim, payload);
+
+    long before = allocations;
+    for (int i = 0; i < 100; i++) {
+        session(modem, sim, payload);
+    }
+    printf("allocations in steady state: %ld\n", allocations - before);
+    CHECK(allocations == before);
+
+    // the counter works: the String variants allocate
+    before = allocations;
+    String eui = modem.deviceEUI();
+    CHECK(allocations > before && eui.length() == 16);
+    return checkResult("test_alloc");
+}
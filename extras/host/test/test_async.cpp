@@ -0,0 +1,201 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The asynchronous engine: while the module takes seconds to answer, the
+// caller's loop keeps running, where the blocking calls stall it
+
+#include <MKRWAN.h>
+#include "SimModem.h"
+#include "check.h"
+#include "session.h"
+
+static uint8_t done_handle;
+static int8_t  done_result;
+
+static void onDone(uint8_t handle, int8_t result)
+{
+    done_handle = handle;
+    done_result = result;
+}
+
+// A sketch loop(): 1 ms of sensor work, then process(). Returns the number
+// of passes until the command completed and the longest pass in ms.
+struct Loop
+{
+    long          passes;
+    unsigned long longest;
+};
+
+static Loop runLoop(LoRaModem& modem)
+{
+    Loop l = { 0, 0 };
+    while (modem.busy()) {
+        unsigned long start = millis();
+        delay(1);
+        modem.process();
+        l.passes++;
+        if (millis() - start > l.longest) {
+            l.longest = millis() - start;
+        }
+    }
+    return l;
+}
+
+// Holds the answer to the commands starting with prefix for delay_us
+static void slowAnswers(SimModem& sim, const char* prefix, uint32_t delay_us)
+{
+    std::string p = prefix;
+    sim.hook = [p, delay_us](SimModem& s, const std::string& cmd) {
+        if (cmd.compare(0, p.size(), p) != 0) {
+            return false;
+        }
+        s.send("+OK\r", delay_us);
+        return true;
+    };
+}
+
+static void testCommand()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    modem.begin(EU868);
+
+    // blocking: one call, the loop does not run for 900 ms
+    slowAnswers(sim, "+DR=", 900000);
+    unsigned long start = millis();
+    CHECK(modem.dataRate(3));
+    CHECK(millis() - start >= 900);
+
+    // asynchronous: the call returns at once and the loop keeps its pace
+    start = millis();
+    done_handle = 0;
+    uint8_t handle = modem.sendCommandAsync("+DR=4", onDone);
+    CHECK(handle != 0);
+    CHECK(millis() - start < 10);
+    CHECK(modem.commandStatus(handle) == LORA_ASYNC_PENDING);
+    Loop l = runLoop(modem);
+    CHECK(l.passes >= 850 && l.longest <= 2);
+    CHECK(done_handle == handle && done_result == 1);
+    CHECK(modem.commandStatus(handle) == 1);
+
+    // no answer: the timeout completes it, the loop still runs
+    sim.hook = [](SimModem&, const std::string& cmd) { return cmd == "+ADR=0"; };
+    handle = modem.sendCommandAsync(500, onDone, "+ADR=0");
+    l = runLoop(modem);
+    CHECK(l.passes >= 450 && l.longest <= 2);
+    CHECK(done_handle == handle && done_result == LORA_ASYNC_TIMEOUT);
+    CHECK(modem.commandStatus(handle) == LORA_ASYNC_TIMEOUT);
+    sim.hook = nullptr;
+
+    // the next blocking call waits for the pending command first
+    handle = modem.sendCommandAsync("+ADR=1", onDone);
+    CHECK(modem.getADR() == 1);
+    CHECK(!modem.busy() && modem.commandStatus(handle) == 1);
+    CHECK(modem.commandStatus(0) == LORA_ASYNC_UNKNOWN);
+}
+
+static void testJoin()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    modem.begin(EU868);
+    sim.join_ms = 8000;
+
+    done_handle = 0;
+    uint8_t handle = modem.joinOTAAAsync(APP_EUI_TEST, APP_KEY_TEST, NULL, DEFAULT_JOIN_TIMEOUT, onDone);
+    CHECK(!modem.connected());
+    Loop l = runLoop(modem);
+    CHECK(l.passes >= 7900 && l.longest <= 2);
+    CHECK(done_handle == handle && done_result == 1);
+    CHECK(modem.connected());
+}
+
+static void testUplink()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    startSession(modem);
+
+    // an uplink answered after its RX windows; the data rate is stale (ADR
+    // on) but nothing is asked to the module before +UTX
+    modem.beginPacket();
+    modem.print("a");
+    CHECK(modem.endPacket() == 1);
+    sim.clearLog();
+    sim.latency_us = 900000;
+    modem.beginPacket();
+    modem.print("ping");
+    done_handle = 0;
+    unsigned long start = millis();
+    uint8_t handle = modem.endPacketAsync(onDone);
+    CHECK(handle != 0);
+    CHECK(millis() - start < 10);
+    CHECK(sim.log.size() == 1 && sim.log[0] == "AT+UTX 4");
+    CHECK(sim.payloads.size() == 1 && sim.payloads[0] == "ping");
+    Loop l = runLoop(modem);
+    CHECK(l.passes >= 850 && l.longest <= 2);
+    CHECK(done_handle == handle && done_result == 1);
+
+    sim.latency_us = 2000;
+    sim.uplinkResult("+ERR_NO_NETWORK\r");
+    handle = modem.sendAsync("x", 1, onDone);
+    runLoop(modem);
+    CHECK(done_handle == handle && done_result == 6);
+}
+
+// Another firmware: the maximum payload is asked to the module, but only
+// by the blocking calls
+static void testOtherFirmware()
+{
+    SimModem sim;
+    sim.params["DEV"] = "OTHER";
+    sim.params["MSIZE"] = "51";
+    LoRaModem modem(sim);
+    startSession(modem);
+
+    // never read: the module judges
+    uint8_t big[60] = { 0 };
+    sim.clearLog();
+    sim.uplinkResult("+ERR_PARAM_OVERFLOW\r");
+    uint8_t handle = modem.sendAsync(big, sizeof(big), onDone);
+    CHECK(handle != 0 && sim.log.size() == 1 && sim.log[0] == "AT+UTX 60");
+    runLoop(modem);
+    CHECK(done_handle == handle && done_result == 5);
+
+    // read by endPacket(): checked locally from then on, even once stale
+    modem.beginPacket();
+    modem.write(big, sizeof(big));
+    CHECK(modem.endPacket() == -20);
+    modem.beginPacket();
+    modem.write(big, 10);
+    CHECK(modem.endPacket() == 10);
+    sim.clearLog();
+    CHECK(modem.sendAsync(big, sizeof(big), onDone) == 0);
+    CHECK(modem.sendAsync(big, 51, onDone) != 0);
+    runLoop(modem);
+    CHECK(sim.log.size() == 1 && sim.log[0] == "AT+UTX 51");
+}
+
+int main()
+{
+    testCommand();
+    testJoin();
+    testUplink();
+    testOtherFirmware();
+    return checkResult("test_async");
+}
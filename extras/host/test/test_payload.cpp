@@ -0,0 +1,270 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// LoRaPayloadEncoder and LoRaPayloadDecoder: field widths, saturation, round
+// trips of every field, and a frame larger than the room left in the packet
+
+#include <MKRWAN.h>
+#include "SimModem.h"
+#include "check.h"
+#include <math.h>
+
+// A buffer refusing bytes once full, like the tx FIFO of the modem
+struct Buffer
+{
+    uint8_t data[16];
+    size_t  len;
+    size_t  room;
+
+    size_t write(uint8_t c)
+    {
+        if (len == room) {
+            return 0;
+        }
+        data[len++] = c;
+        return 1;
+    }
+};
+
+static int32_t encodeFixed(float value, float resolution, uint8_t bytes, size_t* size = NULL)
+{
+    Buffer out = { { 0 }, 0, sizeof(out.data) };
+    LoRaPayloadEncoder<Buffer> enc(out);
+    enc.begin();
+    enc.fixed(value, resolution, bytes);
+    if (size) {
+        *size = enc.end();
+    }
+    // the bytes as written, a float can't hold every 32 bit value
+    uint32_t v = (out.data[0] & 0x80) ? 0xFFFFFFFF : 0;
+    for (size_t i = 0; i < out.len; i++) {
+        v = (v << 8) | out.data[i];
+    }
+    return (int32_t)v;
+}
+
+static void testFixed()
+{
+    size_t size;
+    CHECK(encodeFixed(21.37f, 0.01f, 2) == 2137);
+    CHECK(encodeFixed(-21.375f, 0.01f, 2, &size) == -2138 && size == 2);
+    CHECK(encodeFixed(126.6f, 1, 1) == 127 && encodeFixed(-127.6f, 1, 1) == -128);
+    CHECK(encodeFixed(1e6f, 1, 2) == 32767 && encodeFixed(-1e6f, 1, 2) == -32768);
+    CHECK(encodeFixed(-8388608.4f, 1, 3) == -8388608);
+
+    // 4 bytes: rounding close to 2^31 saturates instead of overflowing
+    CHECK(encodeFixed(2147483520.0f, 1, 4) == 2147483520);
+    CHECK(encodeFixed(2147483647.0f, 1, 4) == 2147483647);
+    CHECK(encodeFixed(3e9f, 1, 4) == 2147483647);
+    CHECK(encodeFixed(-2147483648.0f, 1, 4) == (int32_t)0x80000000);
+    CHECK(encodeFixed(-3e9f, 1, 4) == (int32_t)0x80000000);
+    CHECK(encodeFixed(NAN, 1, 2) == 0);
+
+    Buffer out = { { 0 }, 0, sizeof(out.data) };
+    LoRaPayloadEncoder<Buffer> enc(out);
+    enc.begin();
+    enc.fixed(-21.37f, 0.01f);
+    enc.fixed(100, 0.5f, 1);
+    enc.fixed(-1234567, 1, 3);
+    LoRaPayloadDecoder dec;
+    dec.begin(out.data, enc.end());
+    CHECK(fabsf(dec.fixed(0.01f) + 21.37f) < 0.001f);
+    CHECK(dec.fixed(0.5f, 1) == 63.5f);
+    CHECK(dec.fixed(1, 3) == -1234567);
+    CHECK(dec.ok() && dec.available() == 0);
+
+    // widths out of range are clamped to 1 and 4 bytes
+    CHECK(encodeFixed(300, 1, 0, &size) == 127 && size == 1);
+    CHECK(encodeFixed(3e9f, 1, 9, &size) == 2147483647 && size == 4);
+    const uint8_t two[] = { 0x80, 0x00 };
+    dec.begin(two, sizeof(two));
+    CHECK(dec.fixed(1, 0) == -128 && dec.fixed(1, 200) == 0 && !dec.ok());
+}
+
+static void testVarint()
+{
+    const uint32_t values[] = { 0, 1, 127, 128, 16383, 16384, 2097151, 2097152, 0xFFFFFFFF };
+    const size_t sizes[] = { 1, 1, 1, 2, 2, 3, 3, 4, 5 };
+    Buffer out = { { 0 }, 0, sizeof(out.data) };
+    LoRaPayloadEncoder<Buffer> enc(out);
+    LoRaPayloadDecoder dec;
+    for (int i = 0; i < 9; i++) {
+        out.len = 0;
+        enc.begin();
+        enc.varint(values[i]);
+        CHECK(enc.end() == sizes[i] && enc.ok());
+        dec.begin(out.data, out.len);
+        CHECK(dec.varint() == values[i] && dec.ok() && dec.available() == 0);
+    }
+
+    const int32_t svalues[] = { 0, -1, 1, -64, 63, -65, 64, (int32_t)0x80000000, 0x7FFFFFFF };
+    const size_t ssizes[] = { 1, 1, 1, 1, 1, 2, 2, 5, 5 };
+    for (int i = 0; i < 9; i++) {
+        out.len = 0;
+        enc.begin();
+        enc.svarint(svalues[i]);
+        CHECK(enc.end() == ssizes[i] && enc.ok());
+        dec.begin(out.data, out.len);
+        CHECK(dec.svarint() == svalues[i] && dec.ok() && dec.available() == 0);
+    }
+
+    // truncated
+    const uint8_t cut[] = { 0x80, 0x80 };
+    dec.begin(cut, sizeof(cut));
+    CHECK(dec.varint() == 0 && !dec.ok());
+}
+
+static void testFlags()
+{
+    // 11 flags take two bytes, LSB first; the varint closes the second
+    const bool flags[] = { true, false, true, true, false, false, false, true,
+                           false, true, true };
+    Buffer out = { { 0 }, 0, sizeof(out.data) };
+    LoRaPayloadEncoder<Buffer> enc(out);
+    enc.begin();
+    for (int i = 0; i < 11; i++) {
+        enc.flag(flags[i]);
+    }
+    enc.varint(300);
+    enc.flag(true);
+    CHECK(enc.end() == 5 && enc.ok());
+    CHECK(out.data[0] == 0x8D && out.data[1] == 0x06 && out.data[4] == 0x01);
+
+    LoRaPayloadDecoder dec;
+    dec.begin(out.data, out.len);
+    for (int i = 0; i < 11; i++) {
+        CHECK(dec.flag() == flags[i]);
+    }
+    CHECK(dec.varint() == 300);
+    CHECK(dec.flag() && dec.ok() && dec.available() == 0);
+
+    // exactly 8 flags, then 8 more: a byte each
+    out.len = 0;
+    enc.begin();
+    for (int i = 0; i < 16; i++) {
+        enc.flag(i % 3 == 0);
+    }
+    CHECK(enc.end() == 2 && out.data[0] == 0x49 && out.data[1] == 0x92);
+    dec.begin(out.data, out.len);
+    for (int i = 0; i < 16; i++) {
+        CHECK(dec.flag() == (i % 3 == 0));
+    }
+    CHECK(dec.ok());
+    dec.flag();
+    CHECK(!dec.ok());
+}
+
+// Encodes a and b in slots 0 and 1, then a + 1 in slot 0, returns the size
+static size_t encodeDeltas(LoRaPayloadEncoder<Buffer>& enc, Buffer& out, int32_t a, int32_t b)
+{
+    out.len = 0;
+    enc.begin();
+    enc.delta(0, a);
+    enc.delta(1, b);
+    enc.delta(0, (int32_t)((uint32_t)a + 1));
+    return enc.end();
+}
+
+static void testDelta()
+{
+    Buffer out = { { 0 }, 0, sizeof(out.data) };
+    LoRaPayloadEncoder<Buffer> enc(out);
+    LoRaPayloadDecoder dec;
+
+    // first frame: from 0, then from the slot within the frame
+    CHECK(encodeDeltas(enc, out, 1000, -5) == 4);
+    enc.commit();
+    dec.begin(out.data, out.len);
+    CHECK(dec.delta(0) == 1000 && dec.delta(1) == -5 && dec.delta(0) == 1001 && dec.ok());
+
+    // a frame never sent: not committed, the next one is against the first
+    CHECK(encodeDeltas(enc, out, 500000, 70000) > 4);
+    CHECK(encodeDeltas(enc, out, 1003, -5) == 3);
+    enc.commit();
+    dec.begin(out.data, out.len);
+    CHECK(dec.delta(0) == 1003 && dec.delta(1) == -5 && dec.delta(0) == 1004 && dec.ok());
+    CHECK(dec.available() == 0);
+
+    // across the ends of the int32 range
+    CHECK(encodeDeltas(enc, out, 0x7FFFFFFF, (int32_t)0x80000000) == 11);
+    enc.commit();
+    dec.begin(out.data, out.len);
+    CHECK(dec.delta(0) == 0x7FFFFFFF && dec.delta(1) == (int32_t)0x80000000);
+    CHECK(dec.delta(0) == (int32_t)0x80000000 && dec.ok());
+
+    // a slot out of range cuts the frame on both sides
+    out.len = 0;
+    enc.begin();
+    enc.flag(true);
+    enc.delta(LORA_PAYLOAD_DELTAS, 1);
+    enc.varint(1);
+    CHECK(enc.end() == 1 && !enc.ok());
+    enc.begin();
+    CHECK(enc.ok());
+    const uint8_t two[] = { 0x02, 0x02 };
+    dec.begin(two, sizeof(two));
+    CHECK(dec.delta(LORA_PAYLOAD_DELTAS) == 0 && !dec.ok() && dec.available() == 0);
+    dec.begin(two, sizeof(two));
+    CHECK(dec.delta(0) == (int32_t)0x80000001 && dec.ok());
+
+    // reset() on both: from 0 again
+    enc.reset();
+    dec.reset();
+    CHECK(encodeDeltas(enc, out, 1, 2) == 3);
+    dec.begin(out.data, out.len);
+    CHECK(dec.delta(0) == 1 && dec.delta(1) == 2 && dec.delta(0) == 2);
+}
+
+static void testFull()
+{
+    Buffer out = { { 0 }, 0, 3 };
+    LoRaPayloadEncoder<Buffer> enc(out);
+    enc.begin();
+    enc.fixed(1, 1, 2);
+    CHECK(enc.ok());
+    enc.fixed(2, 1, 2);
+    enc.flag(true);
+    CHECK(enc.end() == 3 && !enc.ok() && out.len == 3);
+    out.len = 0;
+    enc.begin();
+    enc.varint(5);
+    CHECK(enc.end() == 1 && enc.ok());
+
+    // into the packet of a modem with a 16 byte tx FIFO
+    SimModem sim;
+    BasicLoRaModem<256, 16> modem(sim);
+    modem.begin(EU868);
+    LoRaPayloadEncoder<BasicLoRaModem<256, 16> > packet(modem);
+    modem.beginPacket();
+    packet.begin();
+    for (int i = 0; i < 6; i++) {
+        packet.fixed(i, 1, 3);
+    }
+    CHECK(packet.end() == 16 && !packet.ok());
+    CHECK(modem.endPacket() == 16);
+}
+
+int main()
+{
+    testFixed();
+    testVarint();
+    testFlags();
+    testDelta();
+    testFull();
+    return checkResult("test_payload");
+}
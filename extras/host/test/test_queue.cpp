@@ -0,0 +1,274 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The uplink queue and its duty cycle scheduling
+
+#include <MKRWAN.h>
+#include "SimModem.h"
+#include "check.h"
+#include "session.h"
+
+// Moves the clock so that millis() reads ms next
+static void setMillis(uint32_t ms)
+{
+    uint64_t now = hostMicros();
+    uint64_t target = (now / 1000 / 0x100000000ULL) * 0x100000000ULL * 1000 + (uint64_t)ms * 1000;
+    if (target < now) {
+        target += 0x100000000ULL * 1000;
+    }
+    hostAdvance(target - now);
+}
+
+static void testNoDutyCycle()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    startSession(modem, US915);
+
+    // no silence was ever set: past 2^31 ms of uptime the band is still free
+    setMillis(0x80000010UL);
+    CHECK(modem.nextTransmit() == 0);
+    CHECK(modem.enqueue("abc", 3));
+    CHECK(modem.processQueue() == 0);
+    CHECK(sim.payloads.size() == 1 && sim.payloads[0] == "abc");
+    CHECK(modem.nextTransmit() == 0);
+}
+
+static void testDutyCycle()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    startSession(modem);
+
+    // a silence running across the wraparound of millis()
+    setMillis(0xFFFFFFFFUL - 500);
+    CHECK(modem.enqueue("first", 5));
+    CHECK(modem.enqueue("second", 6));
+    CHECK(modem.processQueue() == 1);
+    unsigned long silence = modem.nextTransmit();
+    CHECK(silence > 1000 && silence < 200000);
+    CHECK(modem.processQueue() == 1 && sim.payloads.size() == 1);
+    delay(silence / 2);
+    CHECK(millis() < 0x1000000UL);
+    CHECK(modem.nextTransmit() > 0 && modem.nextTransmit() <= silence / 2 + 1);
+    CHECK(modem.processQueue() == 1);
+    delay(silence / 2 + 1);
+    CHECK(modem.nextTransmit() == 0);
+    CHECK(modem.processQueue() == 0);
+    CHECK(sim.payloads.size() == 2 && sim.payloads[1] == "second");
+}
+
+// The airtime of an uplink comes from the data rate known, never a query
+static void testSendPath()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    startSession(modem);
+
+    // nothing read yet: DR0
+    sim.clearLog();
+    modem.beginPacket();
+    modem.print("hi");
+    CHECK(modem.endPacket() == 2);
+    CHECK(sim.log.size() == 1 && sim.log[0] == "AT+UTX 2");
+    unsigned long silence = modem.nextTransmit();
+    CHECK(silence > 98 * LoRaModem::timeOnAir(EU868, 0, 2) && silence <= 99 * LoRaModem::timeOnAir(EU868, 0, 2));
+
+    // the data rate read last, even once ADR invalidated it
+    CHECK(modem.getDataRate() == 5);
+    delay(silence);
+    sim.clearLog();
+    modem.beginPacket();
+    modem.print("hi");
+    CHECK(modem.endPacket() == 2);
+    CHECK(sim.log.size() == 1 && sim.log[0] == "AT+UTX 2");
+    silence = modem.nextTransmit();
+    CHECK(silence > 98 * LoRaModem::timeOnAir(EU868, 5, 2) && silence <= 99 * LoRaModem::timeOnAir(EU868, 5, 2));
+
+    delay(silence);
+    sim.clearLog();
+    CHECK(modem.dataRate(3));
+    CHECK(modem.sendAsync("hi", 2) != 0);
+    while (modem.process()) {
+    }
+    CHECK(sim.log.size() == 2 && sim.log[1] == "AT+UTX 2");
+    silence = modem.nextTransmit();
+    CHECK(silence > 98 * LoRaModem::timeOnAir(EU868, 3, 2) && silence <= 99 * LoRaModem::timeOnAir(EU868, 3, 2));
+}
+
+// A confirmed frame without its ack still used the band
+static void testFailedOnAir()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    startSession(modem);
+    CHECK(modem.getDataRate() == 5);
+    uint32_t toa = LoRaModem::timeOnAir(EU868, 5, 3);
+    uint32_t budget = modem.airtimeBudget();
+
+    const char* onAir[] = { "+ERR_RX\r", "+ERR_UNKNOWN\r" };
+    for (int i = 0; i < 2; i++) {
+        sim.uplinkResult(onAir[i]);
+        CHECK(modem.enqueue("abc", 3, true));
+        CHECK(modem.processQueue() == 1);
+        CHECK(modem.queueStats().retries == (uint32_t)i + 1);
+        // the retry waits for the silence of the frame, then the backoff
+        CHECK(modem.nextTransmit() >= 98 * toa + LORA_UPLINK_RETRY);
+        CHECK(modem.airtimeBudget() == budget - toa);
+        delay(modem.nextTransmit());
+        CHECK(modem.processQueue() == 0);
+        delay(modem.nextTransmit());
+        budget = modem.airtimeBudget();
+    }
+
+    // +ERR_BUSY: the module sent nothing
+    sim.uplinkResult("+ERR_BUSY\r");
+    CHECK(modem.enqueue("abc", 3, true));
+    CHECK(modem.processQueue() == 1);
+    CHECK(modem.nextTransmit() <= LORA_UPLINK_RETRY);
+    CHECK(modem.airtimeBudget() == budget);
+}
+
+// A confirmed frame answered after its receive windows is sent once
+static void testLateAnswer()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    startSession(modem);
+    CHECK(modem.getDataRate() == 5);
+    uint32_t toa = LoRaModem::timeOnAir(EU868, 5, 3);
+    uint32_t budget = modem.airtimeBudget();
+
+    // within the wait for the RX2 window
+    sim.latency_us = 1500000;
+    CHECK(modem.enqueue("abc", 3, true));
+    CHECK(modem.processQueue() == 0);
+    CHECK(sim.payloads.size() == 1 && modem.queueStats().retries == 0);
+    CHECK(modem.deliveryStats().delivered == 1);
+    delay(modem.nextTransmit());
+
+    // past it: timed out, on air all the same, and settled by the late +OK
+    sim.latency_us = 4000000;
+    CHECK(modem.enqueue("abc", 3, true));
+    CHECK(modem.processQueue() == 1);
+    CHECK(modem.deliveryStats().errors[1] == 1 && modem.queueStats().retries == 1);
+    CHECK(modem.airtimeBudget() == budget - 2 * toa);
+    delay(modem.nextTransmit());
+    CHECK(modem.processQueue() == 0);
+    CHECK(sim.payloads.size() == 2);
+    CHECK(modem.deliveryStats().delivered == 2 && modem.deliveryStats().attempts[0] == 2);
+    CHECK(modem.deliveryStats().errors[1] == 0 && modem.queueStats().retries == 0);
+    CHECK(modem.airtimeBudget() == budget - 2 * toa);
+
+    // and the next frame gets its own answer
+    delay(modem.nextTransmit());
+    sim.latency_us = 2000;
+    sim.uplinkResult("+ERR_NO_NETWORK\r");
+    CHECK(modem.enqueue("abc", 3));
+    CHECK(modem.processQueue() == 0);
+    CHECK(modem.queueStats().dropped == 1 && modem.deliveryStats().errors[6] == 1);
+}
+
+// clearQueue() drops the rest of a fragmented message too
+static void testClearFragments()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    startSession(modem, US915);
+
+    static uint8_t message[1000];
+    CHECK(modem.sendFragmented(message, sizeof(message)));
+    CHECK(modem.fragmentsPending());
+    modem.clearQueue();
+    CHECK(!modem.fragmentsPending());
+    CHECK(modem.processQueue() == 0 && sim.payloads.empty());
+
+    // and a new message can start
+    CHECK(modem.sendFragmented(message, 10));
+    CHECK(modem.processQueue() == 0);
+    CHECK(sim.payloads.size() == 1 && sim.payloads[0].size() == 10 + LORA_FRAGMENT_HEADER);
+}
+
+// A message sent as fragments comes out of the reassembler whole
+static void testReassembly()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    startSession(modem, US915);
+
+    uint8_t message[300];
+    for (size_t i = 0; i < sizeof(message); i++) {
+        message[i] = (uint8_t)(i * 7 + 3);
+    }
+    CHECK(modem.sendFragmented(message, sizeof(message)));
+    while (modem.processQueue() || modem.fragmentsPending()) {
+        delay(modem.nextTransmit());
+    }
+    CHECK(sim.payloads.size() == modem.fragmentCount(sizeof(message)));
+    CHECK(sim.payloads.size() > 2);
+
+    LoRaReassembler<512> r;
+    for (size_t i = 0; i < sim.payloads.size(); i++) {
+        bool last = (i + 1 == sim.payloads.size());
+        CHECK(r.add((const uint8_t*)sim.payloads[i].data(), sim.payloads[i].size()) == last);
+    }
+    CHECK(r.completed() == 1 && r.dropped() == 0);
+    CHECK(r.size() == sizeof(message) && memcmp(r.data(), message, sizeof(message)) == 0);
+
+    // a fragment missing
+    std::vector<std::string> frags = sim.payloads;
+    for (size_t i = 0; i < frags.size(); i++) {
+        if (i != 1) {
+            CHECK(!r.add((const uint8_t*)frags[i].data(), frags[i].size()));
+        }
+    }
+    CHECK(r.completed() == 1 && r.dropped() == 1);
+
+    // two fragments swapped
+    for (size_t i = 0; i < frags.size(); i++) {
+        size_t j = (i == 1) ? 2 : (i == 2) ? 1 : i;
+        CHECK(!r.add((const uint8_t*)frags[j].data(), frags[j].size()));
+    }
+    CHECK(r.completed() == 1 && r.dropped() == 2);
+
+    // and the next message whole again
+    for (size_t i = 0; i < frags.size(); i++) {
+        r.add((const uint8_t*)frags[i].data(), frags[i].size());
+    }
+    CHECK(r.completed() == 2 && r.dropped() == 2);
+    CHECK(r.size() == sizeof(message) && memcmp(r.data(), message, sizeof(message)) == 0);
+
+    // larger than the default buffer
+    LoRaReassembler<> small;
+    for (size_t i = 0; i < frags.size(); i++) {
+        CHECK(!small.add((const uint8_t*)frags[i].data(), frags[i].size()));
+    }
+    CHECK(small.completed() == 0 && small.dropped() == 1);
+}
+
+int main()
+{
+    testNoDutyCycle();
+    testDutyCycle();
+    testSendPath();
+    testFailedOnAir();
+    testLateAnswer();
+    testClearFragments();
+    testReassembly();
+    return checkResult("test_queue");
+}
@@ -0,0 +1,419 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// A whole session against the simulated module: begin, join, uplinks, downlinks
+
+#include <MKRWAN.h>
+#include "SimModem.h"
+#include "check.h"
+#include "session.h"
+#include <algorithm>
+
+static void testBegin()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    CHECK(modem.begin(EU868));
+    CHECK(sim.params["BAND"] == "5");
+    CHECK(sim.params["DUTYCYCLE"] == "1");
+    CHECK(modem.version() == "ARD-078 1.2.1");
+    CHECK(modem.deviceEUI() == "a8610a3233000001");
+    CHECK(modem.getDataRate() == 5);
+    CHECK(modem.getRX2Freq() == 869525000UL);
+    CHECK(modem.isChannelEnabled(0) == 1);
+    CHECK(modem.isChannelEnabled(8) == 0);
+}
+
+static void testJoin()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    modem.begin(EU868);
+    unsigned long start = millis();
+    CHECK(modem.joinOTAA(APP_EUI_TEST, APP_KEY_TEST));
+    // the join answer comes join_ms later, plus the pause after it
+    CHECK(millis() - start >= sim.join_ms);
+    CHECK(sim.params["MODE"] == "1");
+    CHECK(sim.params["APPEUI"] == APP_EUI_TEST);
+    CHECK(sim.params["APPKEY"] == APP_KEY_TEST);
+    CHECK(modem.connected());
+
+    SimModem rejected;
+    rejected.join_accept = false;
+    rejected.join_ms = 100;
+    LoRaModem other(rejected);
+    other.begin(EU868);
+    CHECK(!other.joinOTAA(APP_EUI_TEST, APP_KEY_TEST, 1000));
+}
+
+static void testJoinKeys()
+{
+    // a setter dropped by the module: the batch is sent again, one by one
+    SimModem sim;
+    LoRaModem modem(sim);
+    modem.begin(EU868);
+    bool dropped = false;
+    sim.hook = [&dropped](SimModem&, const std::string& cmd) {
+        if (!dropped && cmd.compare(0, 8, "+APPEUI=") == 0) {
+            dropped = true;
+            return true;
+        }
+        return false;
+    };
+    sim.clearLog();
+    CHECK(modem.joinOTAA(APP_EUI_TEST, APP_KEY_TEST));
+    CHECK(sim.params["APPEUI"] == APP_EUI_TEST);
+    CHECK(sim.log.size() == 7 && sim.log[2] == "AT+MODE=1" && sim.log[5] == "AT+JOIN");
+
+    // a key refused: no join
+    sim.hook = nullptr;
+    sim.reply("+APPKEY=" + std::string(APP_KEY_TEST), "+ERR_PARAM\r");
+    sim.params["NJS"] = "0";
+    sim.clearLog();
+    CHECK(!modem.joinOTAA(APP_EUI_TEST, APP_KEY_TEST));
+    CHECK(!modem.connected());
+    CHECK(modem.joinOTAAAsync(APP_EUI_TEST, APP_KEY_TEST) == 0);
+    for (size_t i = 0; i < sim.log.size(); i++) {
+        CHECK(sim.log[i] != "AT+JOIN");
+    }
+
+    sim.reply("+NWKSKEY=00112233445566778899aabbccddeeff", "+ERR\r");
+    sim.clearLog();
+    CHECK(!modem.joinABP("260b1234", "00112233445566778899aabbccddeeff", "00112233445566778899aabbccddeeff"));
+    CHECK(sim.log.size() == 8 && sim.log.back() == "AT+APPSKEY=00112233445566778899aabbccddeeff");
+}
+
+static void testUplink()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    startSession(modem);
+
+    sim.clearLog();
+    modem.beginPacket();
+    modem.print("hello");
+    CHECK(modem.endPacket() == 5);
+    CHECK(sim.payloads.size() == 1 && sim.payloads[0] == "hello");
+    CHECK(!sim.log.empty() && sim.log.back() == "AT+UTX 5");
+
+    modem.beginPacket();
+    modem.write((uint8_t)0x42);
+    CHECK(modem.endPacket(true) == 1);
+    CHECK(sim.log.back() == "AT+CTX 1");
+
+    const char* errors[] = { "+ERR\r", "+ERR_PARAM\r", "+ERR_BUSY\r", "+ERR_PARAM_OVERFLOW\r",
+                             "+ERR_NO_NETWORK\r", "+ERR_RX\r", "+ERR_UNKNOWN\r" };
+    for (int i = 0; i < 7; i++) {
+        sim.uplinkResult(errors[i]);
+        modem.beginPacket();
+        modem.print("x");
+        CHECK(modem.endPacket(true) == -(i + 2));
+    }
+
+    // no answer at all
+    sim.hook = [](SimModem&, const std::string& cmd) { return cmd.compare(0, 5, "+UTX ") == 0; };
+    modem.beginPacket();
+    modem.print("x");
+    CHECK(modem.endPacket() == -1);
+    sim.hook = nullptr;
+
+    uint8_t big[65] = { 0 };
+    modem.beginPacket();
+    modem.write(big, sizeof(big));
+    CHECK(modem.endPacket() == -20);
+}
+
+static void testDownlink()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    startSession(modem);
+
+    sim.uplinkResult("+OK\r+RECV=3,4\r\n\r\nabcd");
+    modem.beginPacket();
+    modem.print("ping");
+    CHECK(modem.endPacket(true) == 4);
+    delay(100);
+    CHECK(modem.available() == 4);
+    CHECK(modem.getDownlinkPort() == 3);
+    char buf[8] = { 0 };
+    CHECK(modem.read((uint8_t*)buf, sizeof(buf)) == 4);
+    CHECK(strcmp(buf, "abcd") == 0);
+
+    // two downlinks queued, read whole
+    sim.downlink(7, "first");
+    sim.downlink(9, "second");
+    modem.maintain();
+    uint8_t port = 0;
+    CHECK(modem.readMessage((uint8_t*)buf, sizeof(buf), &port) == 5 && port == 7);
+    CHECK(modem.readMessage((uint8_t*)buf, sizeof(buf), &port) == 6 && port == 9);
+    CHECK(modem.readMessage((uint8_t*)buf, sizeof(buf), &port) == -1);
+    CHECK(modem.downlinkStats().received == 3);
+
+    // an empty downlink still carries its port
+    sim.downlink(5, "");
+    modem.maintain();
+    port = 0;
+    CHECK(modem.readMessage((uint8_t*)buf, sizeof(buf), &port) == 0 && port == 5);
+    CHECK(modem.readMessage((uint8_t*)buf, sizeof(buf), &port) == -1);
+    sim.downlink(6, "", 50000);
+    CHECK(modem.read((uint8_t*)buf, sizeof(buf)) == 0);
+    CHECK(modem.readMessage((uint8_t*)buf, sizeof(buf), &port) == 0 && port == 6);
+    CHECK(modem.downlinkStats().received == 5);
+
+    // the stream calls leave it queued, and what follows behind it
+    sim.downlink(5, "");
+    sim.downlink(6, "ab");
+    modem.maintain();
+    unsigned long start = millis();
+    CHECK(modem.available() == 0 && modem.peek() == -1);
+    CHECK(modem.read((uint8_t*)buf, sizeof(buf)) == 0 && millis() - start < 100);
+    CHECK(modem.readMessage((uint8_t*)buf, sizeof(buf), &port) == 0 && port == 5);
+    CHECK(modem.available() == 2 && modem.getDownlinkPort() == 6);
+    CHECK(modem.readMessage((uint8_t*)buf, sizeof(buf), &port) == 2 && port == 6);
+
+    // a downlink arriving while read() waits lands in its buffer
+    sim.downlink(2, "xy", 50000);
+    memset(buf, 0, sizeof(buf));
+    CHECK(modem.read((uint8_t*)buf, sizeof(buf)) == 2);
+    CHECK(strcmp(buf, "xy") == 0 && modem.getDownlinkPort() == 2);
+}
+
+// "port:payload " for each downlink handed to onDownlink()
+static std::string received;
+
+static void onDownlink(uint8_t port, const uint8_t* payload, size_t len)
+{
+    received += std::to_string(port) + ":" + std::string((const char*)payload, len) + " ";
+}
+
+// The handler gets every downlink, in order, queued ones included
+static void testOnReceive()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    startSession(modem);
+
+    // one queued before the handler
+    sim.downlink(1, "old");
+    modem.maintain();
+    received.clear();
+    modem.onReceive(onDownlink);
+    sim.downlink(2, "new");
+    sim.downlink(3, "");
+    sim.downlink(4, "last");
+    modem.maintain();
+    CHECK(received == "1:old 2:new 3: 4:last ");
+    CHECK(modem.available() == 0);
+
+    // queued ones also go out without a new downlink
+    modem.onReceive(NULL);
+    sim.downlink(5, "polled");
+    modem.maintain();
+    received.clear();
+    modem.onReceive(onDownlink);
+    modem.maintain();
+    CHECK(received == "5:polled ");
+
+    // a record wrapping around the end of rx
+    SimModem small;
+    BasicLoRaModem<32, 256> other(small);
+    startSession(other);
+    uint8_t buf[8];
+    small.downlink(6, "abcd");
+    CHECK(other.readMessage(buf, sizeof(buf)) == 4);
+    small.downlink(7, "12345678");
+    small.downlink(8, "hello");
+    other.maintain();
+    received.clear();
+    other.onReceive(onDownlink);
+    other.maintain();
+    CHECK(received == "7:12345678 8:hello ");
+    CHECK(other.downlinkStats().dropped == 0);
+}
+
+// The cached getters, in _lora_cache order without LORA_CACHE_MSIZE
+enum { GET_DR, GET_ADR, GET_RX2DR, GET_RX2FQ, GET_CHANMASK, GET_DEVADDR, GET_VERSION, GETTERS };
+
+// Calls a cached getter, true if it was answered from RAM without a command
+static bool cacheHit(LoRaModem& modem, SimModem& sim, int getter)
+{
+    LoRaCacheStats before = modem.cacheStats();
+    size_t sent = sim.log.size();
+    char buf[32];
+    uint16_t mask[6];
+    switch (getter) {
+        case GET_DR:       CHECK(modem.getDataRate() == atoi(sim.params["DR"].c_str())); break;
+        case GET_ADR:      CHECK(modem.getADR() == atoi(sim.params["ADR"].c_str())); break;
+        case GET_RX2DR:    CHECK(modem.getRX2DR() == 0); break;
+        case GET_RX2FQ:    CHECK(modem.getRX2Freq() == 869525000UL); break;
+        case GET_CHANMASK: CHECK(modem.getChannelMask(mask) && mask[0] == 0x00ff); break;
+        case GET_DEVADDR:  CHECK(modem.getDevAddr(buf, sizeof(buf)) == 8); break;
+        case GET_VERSION:  CHECK(modem.version(buf, sizeof(buf)) > 0); break;
+    }
+    const LoRaCacheStats& after = modem.cacheStats();
+    bool hit = (after.hits == before.hits + 1 && after.misses == before.misses);
+    CHECK(hit || (after.misses == before.misses + 1 && after.hits == before.hits));
+    CHECK(hit == (sim.log.size() == sent));
+    return hit;
+}
+
+// The getters answered from RAM, as a bit per getter
+static unsigned cacheHits(LoRaModem& modem, SimModem& sim)
+{
+    unsigned hits = 0;
+    for (int i = 0; i < GETTERS; i++) {
+        if (cacheHit(modem, sim, i)) {
+            hits |= 1 << i;
+        }
+    }
+    return hits;
+}
+
+static void testCache()
+{
+    const unsigned all = (1 << GETTERS) - 1;
+    const unsigned network = (1 << GET_DR) | (1 << GET_CHANMASK);
+    const unsigned downlink = network | (1 << GET_RX2DR) | (1 << GET_RX2FQ);
+
+    SimModem sim;
+    LoRaModem modem(sim);
+    startSession(modem);
+
+    // read once, then from RAM
+    cacheHits(modem, sim);
+    sim.clearLog();
+    CHECK(cacheHits(modem, sim) == all);
+    CHECK(cacheHits(modem, sim) == all);
+    CHECK(sim.log.empty());
+
+    // an uplink with ADR on: the network may have changed the data rate
+    // and the channels
+    modem.beginPacket();
+    modem.print("x");
+    CHECK(modem.endPacket() == 1);
+    CHECK(cacheHits(modem, sim) == (all & ~network));
+
+    // with ADR off, nothing
+    CHECK(modem.setADR(false));
+    cacheHits(modem, sim);
+    modem.beginPacket();
+    modem.print("x");
+    CHECK(modem.endPacket() == 1);
+    CHECK(cacheHits(modem, sim) == all);
+
+    // a downlink may carry MAC commands, the RX2 settings too
+    sim.downlink(3, "ab");
+    modem.maintain();
+    CHECK(modem.available() == 2);
+    CHECK(cacheHits(modem, sim) == (all & ~downlink));
+
+    // a restart: all of it, the version read again on the way
+    sim.clearLog();
+    CHECK(modem.restart());
+    CHECK(std::find(sim.log.begin(), sim.log.end(), "AT+DEV?") != sim.log.end());
+    CHECK(cacheHits(modem, sim) == (1 << GET_VERSION));
+    CHECK(cacheHits(modem, sim) == all);
+}
+
+// Edits of a LoRaChannelMask reach the module in one command, or none
+static void testChannelMask()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    startSession(modem, US915);
+
+    LoRaChannelMask mask;
+    CHECK(modem.getChannelMask(mask) && !mask.dirty());
+    CHECK(mask.word(0) == 0x00ff && mask.isEnabled(7) && !mask.isEnabled(8));
+
+    // sub-band 2: channels 8 to 15 and 65
+    mask.selectSubBand(2);
+    CHECK(mask.dirty());
+    const uint16_t words[] = { 0xff00, 0x0000, 0x0000, 0x0000, 0x0002, 0x0000 };
+    for (int i = 0; i < 6; i++) {
+        CHECK(mask.word(i) == words[i]);
+    }
+    sim.clearLog();
+    CHECK(modem.commitChannelMask(mask) && !mask.dirty());
+    CHECK(sim.log.size() == 1 && sim.log[0] == "AT+CHANMASK=ff00000000000000" "00020000");
+    CHECK(sim.params["CHANMASK"] == "ff00000000000000" "00020000");
+
+    // the module holds it now: nothing to send, nothing to read back
+    sim.clearLog();
+    CHECK(modem.commitChannelMask(mask));
+    LoRaChannelMask again;
+    CHECK(modem.getChannelMask(again) && !again.dirty());
+    CHECK(sim.log.empty());
+    for (int i = 0; i < 6; i++) {
+        CHECK(again.word(i) == words[i]);
+    }
+
+    // refused: still dirty, sent again by the next commit
+    mask.enable(0);
+    sim.reply("+CHANMASK=ff01000000000000" "00020000", "+ERR\r");
+    sim.clearLog();
+    CHECK(!modem.commitChannelMask(mask) && mask.dirty());
+    CHECK(sim.log.size() == 1);
+    sim.replies.clear();
+    CHECK(modem.commitChannelMask(mask) && !mask.dirty());
+    CHECK(sim.log.size() == 2 && sim.log[1] == sim.log[0]);
+    CHECK(sim.params["CHANMASK"] == "ff01000000000000" "00020000");
+}
+
+// The idle time is the part of the command time spent waiting
+static void testWaitStats()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    modem.begin(EU868);
+    modem.resetWaitStats();
+
+    // waiting for a downlink is not a command
+    modem.setTimeout(100);
+    uint8_t buf[8];
+    CHECK(modem.read(buf, sizeof(buf)) == 0);
+    CHECK(modem.available() == 0);
+    CHECK(modem.waitStats().commands == 0 && modem.waitStats().idle_us == 0);
+
+    CHECK(modem.dataRate(3));
+    const LoRaWaitStats& s = modem.waitStats();
+    CHECK(s.commands == 1 && s.last_us >= sim.latency_us);
+    CHECK(s.idle_us > 0 && s.idle_us == s.last_idle_us && s.idle_us <= s.total_us);
+
+    // no answer to wait for, the call is over all the same
+    modem.setBaud(19200);
+    CHECK(s.commands == 2);
+    delay(5000);
+    CHECK(modem.dataRate(3));
+    CHECK(s.commands == 3 && s.last_us < 100000);
+}
+
+int main()
+{
+    testBegin();
+    testJoin();
+    testJoinKeys();
+    testUplink();
+    testDownlink();
+    testOnReceive();
+    testCache();
+    testChannelMask();
+    testWaitStats();
+    return checkResult("test_session");
+}
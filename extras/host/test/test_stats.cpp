@@ -0,0 +1,161 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The per command family statistics, built with LORA_STATS
+
+#include <MKRWAN.h>
+#include "SimModem.h"
+#include "check.h"
+#include "session.h"
+
+static LoRaCommandStats family(LoRaModem& modem, int f)
+{
+    LoRaStatsSnapshot s;
+    modem.statsSnapshot(s);
+    return s.family[f];
+}
+
+static void testFamilies()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    startSession(modem);
+    modem.resetStats();
+
+    modem.beginPacket();
+    modem.print("a");
+    CHECK(modem.endPacket() == 1);
+    modem.beginPacket();
+    modem.print("b");
+    CHECK(modem.endPacket(true) == 1);
+    CHECK(modem.dataRate(3));
+    modem.invalidateCache();
+    CHECK(modem.getDataRate() == 3);
+    CHECK(modem.sendMask("ff0000000000000000000000"));
+    CHECK(modem.joinOTAA(APP_EUI_TEST, APP_KEY_TEST));
+    CHECK(modem.factoryDefault());
+
+    const int families[] = { LORA_CMD_UTX, LORA_CMD_CTX, LORA_CMD_SET, LORA_CMD_GET,
+                             LORA_CMD_CHANMASK, LORA_CMD_JOIN, LORA_CMD_BATCH, LORA_CMD_OTHER };
+    for (int i = 0; i < 8; i++) {
+        LoRaCommandStats f = family(modem, families[i]);
+        CHECK(f.count == 1 && f.timeouts == 0);
+        // a batch counts the answers of each of its commands
+        CHECK(f.responses[0] == (families[i] == LORA_CMD_BATCH ? 3u : 1u));
+        CHECK(f.min_us == f.max_us && f.avg_us == f.total_us && f.p99_us == f.max_us);
+    }
+
+    // +ERR_* in the order of the endPacket() errors
+    modem.resetStats();
+    const char* errors[] = { "+ERR\r", "+ERR_PARAM\r", "+ERR_BUSY\r", "+ERR_PARAM_OVERFLOW\r",
+                             "+ERR_NO_NETWORK\r", "+ERR_RX\r", "+ERR_UNKNOWN\r" };
+    for (int i = 0; i < 7; i++) {
+        sim.uplinkResult(errors[i]);
+        modem.beginPacket();
+        modem.print("x");
+        CHECK(modem.endPacket(true) == -(i + 2));
+    }
+    LoRaCommandStats ctx = family(modem, LORA_CMD_CTX);
+    CHECK(ctx.count == 7 && ctx.responses[0] == 0);
+    for (int i = 1; i < 8; i++) {
+        CHECK(ctx.responses[i] == 1);
+    }
+    CHECK(family(modem, LORA_CMD_UTX).count == 0);
+}
+
+static void testTimeouts()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    startSession(modem);
+    modem.resetStats();
+
+    // no answer, then an answer matching nothing
+    sim.hook = [](SimModem&, const std::string& cmd) { return cmd == "+ADR?"; };
+    CHECK(modem.getADR() == -1);
+    // at most the \r ending the join event, left over
+    LoRaStatsSnapshot s;
+    modem.statsSnapshot(s);
+    uint32_t left = s.unhandled_bytes;
+    CHECK(left <= 1);
+    sim.hook = [](SimModem& m, const std::string& cmd) {
+        if (cmd != "+ADR?") {
+            return false;
+        }
+        m.send("+XYZ\r", 1000);
+        return true;
+    };
+    CHECK(modem.getADR() == -1);
+    modem.statsSnapshot(s);
+    CHECK(s.family[LORA_CMD_GET].count == 2 && s.family[LORA_CMD_GET].timeouts == 2);
+    CHECK(s.family[LORA_CMD_GET].responses[0] == 0);
+    CHECK(s.unhandled_bytes == left + 5);
+}
+
+// Answers the setters after the given delays in turn
+static void runSetters(SimModem& sim, LoRaModem& modem, int fast, int slow)
+{
+    int n = 0;
+    sim.hook = [&n, fast](SimModem& s, const std::string& cmd) {
+        if (cmd.compare(0, 4, "+DR=") != 0) {
+            return false;
+        }
+        s.send("+OK\r", n++ < fast ? 1000 : 100000);
+        return true;
+    };
+    modem.resetStats();
+    for (int i = 0; i < fast + slow; i++) {
+        CHECK(modem.dataRate(3));
+    }
+    sim.hook = nullptr;
+}
+
+static void testPercentile()
+{
+    SimModem sim;
+    LoRaModem modem(sim);
+    startSession(modem);
+
+    // one slow command in a hundred: the 99th percentile is the fast bucket
+    runSetters(sim, modem, 99, 1);
+    LoRaCommandStats f = family(modem, LORA_CMD_SET);
+    CHECK(f.count == 100 && f.max_us >= 100000);
+    int fast = -1;
+    int slow = -1;
+    for (int b = 0; b < LORA_STATS_BUCKETS; b++) {
+        if (f.histogram[b] == 99) fast = b;
+        if (f.histogram[b] == 1) slow = b;
+    }
+    CHECK(fast >= 0 && slow > fast);
+    CHECK(f.p99_us == (1000u << fast) && f.p99_us < f.max_us);
+    CHECK(f.avg_us == f.total_us / f.count && f.avg_us > f.min_us && f.avg_us < f.p99_us);
+
+    // two in a hundred: it is the slow one, bounded by the maximum
+    runSetters(sim, modem, 98, 2);
+    f = family(modem, LORA_CMD_SET);
+    CHECK(f.count == 100 && f.p99_us == f.max_us);
+    CHECK(f.avg_us == f.total_us / f.count);
+}
+
+int main()
+{
+    testFamilies();
+    testTimeouts();
+    testPercentile();
+    return checkResult("test_stats");
+}
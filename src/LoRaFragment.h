@@ -0,0 +1,140 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/*
+ * Fragments of messages larger than a LoRaWAN frame. Every fragment starts
+ * with one header byte:
+ *   bits 7-6  message id, increments with every message
+ *   bit  5    last fragment of the message
+ *   bits 4-0  fragment index, from 0
+ * followed by as many bytes of the message as the frame can carry.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define LORA_FRAGMENT_HEADER  1
+#define LORA_FRAGMENT_LAST    0x20
+#define LORA_FRAGMENT_INDEX   0x1F
+#define LORA_FRAGMENT_MAX     32    // fragments per message
+#define LORA_FRAGMENT_HDR(id, last, index) \
+    ((uint8_t)(((id) << 6) | ((last) ? LORA_FRAGMENT_LAST : 0) | ((index) & LORA_FRAGMENT_INDEX)))
+
+#if !defined(LORA_REASSEMBLY_BUFFER)
+  #define LORA_REASSEMBLY_BUFFER 256
+#endif
+
+/*
+ * Rebuilds messages from fragments received in order, e.g. from the
+ * onReceive() handler. A missing fragment drops the message.
+ */
+template<size_t N = LORA_REASSEMBLY_BUFFER>
+class LoRaReassembler
+{
+public:
+    LoRaReassembler()
+    {
+        reset();
+        _completed = 0;
+        _dropped = 0;
+    }
+
+    void reset()
+    {
+        _active = false;
+        _size = 0;
+    }
+
+    // Adds a fragment, header included; true when it completes a message
+    bool add(const uint8_t* frag, size_t len)
+    {
+        if (len < LORA_FRAGMENT_HEADER) {
+            return false;
+        }
+        uint8_t id = frag[0] >> 6;
+        uint8_t index = frag[0] & LORA_FRAGMENT_INDEX;
+        if (index == 0) {
+            if (_active) {
+                _dropped++;
+            }
+            _active = true;
+            _id = id;
+            _next = 0;
+            _size = 0;
+        } else if (!_active || id != _id || index != _next) {
+            drop();
+            return false;
+        }
+        len -= LORA_FRAGMENT_HEADER;
+        if (_size + len > N) {
+            drop();
+            return false;
+        }
+        memcpy(_buf + _size, frag + LORA_FRAGMENT_HEADER, len);
+        _size += len;
+        _next++;
+        if (frag[0] & LORA_FRAGMENT_LAST) {
+            _active = false;
+            _completed++;
+            return true;
+        }
+        return false;
+    }
+
+    // The last message completed by add()
+    const uint8_t* data()
+    {
+        return _buf;
+    }
+
+    size_t size()
+    {
+        return _size;
+    }
+
+    uint32_t completed()
+    {
+        return _completed;
+    }
+
+    // Messages lost to a missing fragment or too large for the buffer
+    uint32_t dropped()
+    {
+        return _dropped;
+    }
+
+private:
+    void drop()
+    {
+        if (_active) {
+            _dropped++;
+        }
+        reset();
+    }
+
+    uint8_t  _buf[N];
+    size_t   _size;
+    bool     _active;
+    uint8_t  _id;
+    uint8_t  _next;
+    uint32_t _completed;
+    uint32_t _dropped;
+};
@@ -0,0 +1,309 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/*
+ * Compact binary payloads, decoded the same way on the node and, e.g., in a
+ * network server integration.
+ *
+ * Fields are written and read back in the same order:
+ *   fixed(v, res, n)  v / res rounded and saturated to an n byte signed int,
+ *                     big endian, n from 1 to 4
+ *   varint(v)         unsigned LEB128, 1 byte up to 127
+ *   svarint(v)        zig-zag then varint, 1 byte for -64..63
+ *   delta(slot, v)    svarint of v minus the value of the slot in the last
+ *                     committed frame, slot below LORA_PAYLOAD_DELTAS
+ *   flag(b)           consecutive flags share a byte, LSB first; any other
+ *                     field closes the byte
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if !defined(LORA_PAYLOAD_DELTAS)
+  #define LORA_PAYLOAD_DELTAS 4
+#endif
+
+/*
+ * Out is anything with a write(uint8_t) method: LoRaModem (the bytes go to
+ * the packet opened by beginPacket()), or a buffer on the host.
+ */
+template<class Out>
+class LoRaPayloadEncoder
+{
+public:
+    LoRaPayloadEncoder(Out& out) : _out(out)
+    {
+        reset();
+    }
+
+    // Starts a frame
+    void begin()
+    {
+        _size = 0;
+        _bits = 0;
+        _nbits = 0;
+        _ok = true;
+        for (int i = 0; i < LORA_PAYLOAD_DELTAS; i++) {
+            _next[i] = _last[i];
+        }
+    }
+
+    // Ends the frame, returns the bytes actually written
+    size_t end()
+    {
+        closeFlags();
+        return _size;
+    }
+
+    // False once a byte could not be written (packet full) or a delta slot
+    // was out of range: the frame is cut at that point
+    bool ok()
+    {
+        return _ok;
+    }
+
+    // Makes the frame the reference of the next deltas, once it was sent
+    void commit()
+    {
+        for (int i = 0; i < LORA_PAYLOAD_DELTAS; i++) {
+            _last[i] = _next[i];
+        }
+    }
+
+    // Deltas start again from 0, e.g. after a rejoin
+    void reset()
+    {
+        for (int i = 0; i < LORA_PAYLOAD_DELTAS; i++) {
+            _last[i] = 0;
+            _next[i] = 0;
+        }
+        _size = 0;
+        _bits = 0;
+        _nbits = 0;
+        _ok = true;
+    }
+
+    void fixed(float value, float resolution, uint8_t bytes = 2)
+    {
+        closeFlags();
+        bytes = clampBytes(bytes);
+        // rounded first, then saturated: with 4 bytes q + 0.5 may reach 2^31
+        float q = value / resolution;
+        q += (q >= 0 ? 0.5f : -0.5f);
+        int32_t max = (int32_t)((1UL << (8 * bytes - 1)) - 1);
+        int32_t v;
+        if (q >= (float)max) {
+            v = max;
+        } else if (q <= (float)(-max - 1)) {
+            v = -max - 1;
+        } else if (q == q) {
+            v = (int32_t)q;
+        } else {
+            v = 0;  // NaN
+        }
+        while (bytes--) {
+            put((uint8_t)(v >> (8 * bytes)));
+        }
+    }
+
+    void varint(uint32_t value)
+    {
+        closeFlags();
+        while (value >= 0x80) {
+            put((uint8_t)(value | 0x80));
+            value >>= 7;
+        }
+        put((uint8_t)value);
+    }
+
+    void svarint(int32_t value)
+    {
+        varint(((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+    }
+
+    void delta(uint8_t slot, int32_t value)
+    {
+        if (slot >= LORA_PAYLOAD_DELTAS) {
+            closeFlags();
+            _ok = false;
+            return;
+        }
+        svarint((int32_t)((uint32_t)value - (uint32_t)_next[slot]));
+        _next[slot] = value;
+    }
+
+    void flag(bool on)
+    {
+        if (_nbits == 8) {
+            closeFlags();
+        }
+        if (on) {
+            _bits |= 1 << _nbits;
+        }
+        _nbits++;
+    }
+
+private:
+    static uint8_t clampBytes(uint8_t bytes)
+    {
+        return bytes < 1 ? 1 : bytes > 4 ? 4 : bytes;
+    }
+
+    void put(uint8_t c)
+    {
+        if (_ok && _out.write(c) == 1) {
+            _size++;
+        } else {
+            _ok = false;
+        }
+    }
+
+    void closeFlags()
+    {
+        if (_nbits) {
+            put(_bits);
+            _bits = 0;
+            _nbits = 0;
+        }
+    }
+
+    Out&     _out;
+    size_t   _size;
+    uint8_t  _bits;
+    uint8_t  _nbits;
+    bool     _ok;
+    int32_t  _last[LORA_PAYLOAD_DELTAS];
+    int32_t  _next[LORA_PAYLOAD_DELTAS];
+};
+
+/*
+ * Reads back what LoRaPayloadEncoder wrote. The delta slots follow every
+ * frame decoded, which must be all the frames the encoder committed.
+ * Reading past the end, a truncated varint or a delta slot out of range
+ * clears ok() and returns 0.
+ */
+class LoRaPayloadDecoder
+{
+public:
+    LoRaPayloadDecoder()
+    {
+        reset();
+        begin(NULL, 0);
+    }
+
+    void begin(const uint8_t* buf, size_t len)
+    {
+        _p = buf;
+        _end = buf + len;
+        _bits = 0;
+        _nbits = 0;
+        _ok = true;
+    }
+
+    void reset()
+    {
+        for (int i = 0; i < LORA_PAYLOAD_DELTAS; i++) {
+            _last[i] = 0;
+        }
+    }
+
+    bool ok()
+    {
+        return _ok;
+    }
+
+    // Bytes not read yet
+    size_t available()
+    {
+        return _end - _p;
+    }
+
+    float fixed(float resolution, uint8_t bytes = 2)
+    {
+        _nbits = 0;
+        bytes = bytes < 1 ? 1 : bytes > 4 ? 4 : bytes;
+        if (available() < bytes) {
+            _ok = false;
+            _p = _end;
+            return 0;
+        }
+        uint32_t v = (*_p & 0x80) ? 0xFFFFFFFF : 0;
+        while (bytes--) {
+            v = (v << 8) | *_p++;
+        }
+        return (int32_t)v * resolution;
+    }
+
+    uint32_t varint()
+    {
+        _nbits = 0;
+        uint32_t v = 0;
+        for (uint8_t shift = 0; shift < 35; shift += 7) {
+            if (_p == _end) {
+                break;
+            }
+            uint8_t c = *_p++;
+            v |= (uint32_t)(c & 0x7F) << shift;
+            if (!(c & 0x80)) {
+                return v;
+            }
+        }
+        _ok = false;
+        return 0;
+    }
+
+    int32_t svarint()
+    {
+        uint32_t v = varint();
+        return (int32_t)((v >> 1) ^ (0 - (v & 1)));
+    }
+
+    int32_t delta(uint8_t slot)
+    {
+        if (slot >= LORA_PAYLOAD_DELTAS) {
+            _ok = false;
+            _p = _end;
+            return 0;
+        }
+        _last[slot] = (int32_t)((uint32_t)_last[slot] + (uint32_t)svarint());
+        return _last[slot];
+    }
+
+    bool flag()
+    {
+        if (_nbits == 0 || _nbits == 8) {
+            if (_p == _end) {
+                _ok = false;
+                return false;
+            }
+            _bits = *_p++;
+            _nbits = 0;
+        }
+        return (_bits >> _nbits++) & 1;
+    }
+
+private:
+    const uint8_t* _p;
+    const uint8_t* _end;
+    uint8_t  _bits;
+    uint8_t  _nbits;
+    bool     _ok;
+    int32_t  _last[LORA_PAYLOAD_DELTAS];
+};
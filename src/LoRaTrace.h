@@ -0,0 +1,249 @@
+/*
+  This file is part of the MKRWAN library.
+  Copyright (C) 2017  Arduino AG (http://www.arduino.cc/)
+
+  MKRWAN library is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  MKRWAN library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with MKRWAN library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/*
+ * Traces of the UART traffic with the module. A trace is a sequence of
+ * records:
+ *   byte 0     bit 7 direction (LORA_TRACE_RX from the module), bits 6-0
+ *              number of bytes, 1 to 127
+ *   bytes 1-4  micros() of the first byte, little endian
+ *   then the bytes
+ * Bytes going the same way less than LORA_TRACE_GAP us apart share a
+ * record.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LORA_TRACE_HEADER 5
+#define LORA_TRACE_TX     0x00
+#define LORA_TRACE_RX     0x80
+#define LORA_TRACE_MAX    0x7F  // bytes per record
+
+#if !defined(LORA_TRACE_BUFFER)
+  #define LORA_TRACE_BUFFER 1024
+#endif
+
+#if !defined(LORA_TRACE_GAP)
+  #define LORA_TRACE_GAP 1000
+#endif
+
+/*
+ * Keeps the most recent records, the oldest ones are dropped to make room.
+ */
+template<size_t N = LORA_TRACE_BUFFER>
+class LoRaTrace
+{
+  static_assert(N > LORA_TRACE_HEADER, "a trace holds at least one record");
+
+public:
+    LoRaTrace()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        _start = 0;
+        _used = 0;
+        _open = false;
+        _dropped = 0;
+    }
+
+    void add(uint8_t dir, const uint8_t* data, size_t len, uint32_t now)
+    {
+        while (len--) {
+            add(dir, *data++, now);
+        }
+    }
+
+    void add(uint8_t dir, uint8_t c, uint32_t now)
+    {
+        bool extend = _open && dir == _dir && _len < LORA_TRACE_MAX && now - _prev < LORA_TRACE_GAP;
+        if (extend) {
+            reserve(1);
+            // unless that dropped the record being extended
+            extend = _open;
+        }
+        if (extend) {
+            _len++;
+            _buf[_last] = dir | _len;
+        } else {
+            reserve(LORA_TRACE_HEADER + 1);
+            _last = pos(_used);
+            put(dir | 1);
+            for (int i = 0; i < 4; i++) {
+                put((uint8_t)(now >> (8 * i)));
+            }
+            _open = true;
+            _dir = dir;
+            _len = 1;
+        }
+        put(c);
+        _prev = now;
+    }
+
+    // Bytes of records held
+    size_t size()
+    {
+        return _used;
+    }
+
+    // Records dropped to make room
+    uint32_t dropped()
+    {
+        return _dropped;
+    }
+
+    // Writes the records, oldest first, to anything with a
+    // write(const uint8_t*, size_t) method
+    template<class Out>
+    size_t dump(Out& out)
+    {
+        size_t n = N - _start < _used ? N - _start : _used;
+        out.write(_buf + _start, n);
+        if (n < _used) {
+            out.write(_buf, _used - n);
+        }
+        return _used;
+    }
+
+private:
+    size_t pos(size_t offset)
+    {
+        return (_start + offset) % N;
+    }
+
+    void put(uint8_t c)
+    {
+        _buf[pos(_used)] = c;
+        _used++;
+    }
+
+    void reserve(size_t n)
+    {
+        while (N - _used < n) {
+            size_t len = LORA_TRACE_HEADER + (_buf[_start] & LORA_TRACE_MAX);
+            if (_start == _last) {
+                _open = false;
+            }
+            _start = pos(len);
+            _used -= len;
+            _dropped++;
+        }
+    }
+
+    uint8_t  _buf[N];
+    size_t   _start;
+    size_t   _used;
+    size_t   _last;   // header of the newest record
+    bool     _open;
+    uint8_t  _dir;
+    uint8_t  _len;
+    uint32_t _prev;   // time of the last byte
+    uint32_t _dropped;
+};
+
+/*
+ * Walks the records of a dumped trace. A truncated last record is ignored.
+ * The accessors describe the record found by the last successful next().
+ */
+class LoRaTraceReader
+{
+public:
+    LoRaTraceReader(const uint8_t* buf = NULL, size_t len = 0)
+    {
+        begin(buf, len);
+    }
+
+    void begin(const uint8_t* buf, size_t len)
+    {
+        _buf = buf;
+        _len = len;
+        _next = 0;
+        _offset = 0;
+        _size = 0;
+    }
+
+    // Moves to the next record, true if there is one
+    bool next()
+    {
+        if (_next + LORA_TRACE_HEADER > _len) {
+            _offset = _next = _len;
+            _size = 0;
+            return false;
+        }
+        size_t size = _buf[_next] & LORA_TRACE_MAX;
+        if (_next + LORA_TRACE_HEADER + size > _len) {
+            _offset = _next = _len;
+            _size = 0;
+            return false;
+        }
+        _offset = _next;
+        _size = size;
+        _next += LORA_TRACE_HEADER + size;
+        return true;
+    }
+
+    // Moves to the next record going the dir way
+    bool next(uint8_t dir)
+    {
+        while (next()) {
+            if (direction() == dir) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint8_t direction()
+    {
+        return _buf[_offset] & LORA_TRACE_RX;
+    }
+
+    uint32_t time()
+    {
+        const uint8_t* p = _buf + _offset + 1;
+        return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+    }
+
+    const uint8_t* data()
+    {
+        return _buf + _offset + LORA_TRACE_HEADER;
+    }
+
+    size_t size()
+    {
+        return _size;
+    }
+
+    // Position of the record in the trace, its length once past the end
+    size_t offset()
+    {
+        return _offset;
+    }
+
+private:
+    const uint8_t* _buf;
+    size_t _len;
+    size_t _next;
+    size_t _offset;
+    size_t _size;
+};
@@ -22,6 +22,10 @@
 #pragma once
 
 #include "Arduino.h"
+// these three only need the C library, so they build on a host as they are
+#include "LoRaPayload.h"
+#include "LoRaFragment.h"
+#include "LoRaTrace.h"
 
 #ifdef PORTENTA_CARRIER
 #undef LORA_RESET
@@ -32,9 +36,24 @@
 
 #define DEFAULT_JOIN_TIMEOUT 60000L
 
+/*
+ * Ring buffer with free running indices: N must be a power of two so that
+ * positions are obtained by masking, which avoids the division that a modulo
+ * costs on cores without a hardware divider (Cortex-M0+).
+ * All the N slots are usable.
+ *
+ * It is a lock-free single producer / single consumer queue: the writer only
+ * ever stores _w and the reader only ever stores _r, each published with
+ * release semantics after the data it covers. The writing API can therefore
+ * be called from an interrupt handler (non blocking, t = false) while the
+ * reading API runs in loop(), or the other way around.
+ * clear() touches both sides and needs the other context to be quiet.
+ */
 template <class T, unsigned N>
 class SerialFifo
 {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "SerialFifo size must be a power of two");
+
 public:
     SerialFifo()
     {
@@ -43,8 +62,8 @@ public:
 
     void clear()
     {
-        _r = 0;
-        _w = 0;
+        __atomic_store_n(&_r, 0u, __ATOMIC_RELAXED);
+        __atomic_store_n(&_w, 0u, __ATOMIC_RELEASE);
     }
 
     // writing thread/context API
@@ -57,21 +76,17 @@ public:
 
     int free(void)
     {
-        int s = _r - _w;
-        if (s <= 0)
-            s += N;
-        return s - 1;
+        unsigned w = __atomic_load_n(&_w, __ATOMIC_RELAXED);
+        return N - (w - __atomic_load_n(&_r, __ATOMIC_ACQUIRE));
     }
 
     bool put(const T& c)
     {
-        int i = _w;
-        int j = i;
-        i = _inc(i);
-        if (i == _r) // !writeable()
+        unsigned w = __atomic_load_n(&_w, __ATOMIC_RELAXED);
+        if (w - __atomic_load_n(&_r, __ATOMIC_ACQUIRE) == N) // !writeable()
             return false;
-        _b[j] = c;
-        _w = i;
+        _b[w & MASK] = c;
+        __atomic_store_n(&_w, w + 1, __ATOMIC_RELEASE);
         return true;
     }
 
@@ -88,50 +103,76 @@ public:
             }
             // check free space
             if (c < f) f = c;
-            int w = _w;
-            int m = N - w;
+            unsigned w = __atomic_load_n(&_w, __ATOMIC_RELAXED);
+            int m = N - (w & MASK);
             // check wrap
             if (f > m) f = m;
-            memcpy(&_b[w], p, f);
-            _w = _inc(w, f);
+            memcpy(&_b[w & MASK], p, f * sizeof(T));
+            __atomic_store_n(&_w, w + f, __ATOMIC_RELEASE);
             c -= f;
             p += f;
         }
         return n - c;
     }
 
+    // Zero copy write: returns the number of contiguous free slots at *p,
+    // fill (part of) them and publish with commit(). Once the first span is
+    // committed a second call returns the one starting over at the head.
+    size_t reserveContiguous(T** p)
+    {
+        unsigned w = __atomic_load_n(&_w, __ATOMIC_RELAXED);
+        unsigned f = N - (w - __atomic_load_n(&_r, __ATOMIC_ACQUIRE));
+        unsigned m = N - (w & MASK);
+        *p = &_b[w & MASK];
+        return (f > m) ? m : f;
+    }
+
+    void commit(size_t n)
+    {
+        unsigned w = __atomic_load_n(&_w, __ATOMIC_RELAXED);
+        __atomic_store_n(&_w, w + (unsigned)n, __ATOMIC_RELEASE);
+    }
+
     // reading thread/context API
     // --------------------------------------------------------
 
     bool readable(void)
     {
-        return (_r != _w);
+        return size() != 0;
     }
 
     size_t size(void)
     {
-        int s = _w - _r;
-        if (s < 0)
-            s += N;
-        return s;
+        unsigned r = __atomic_load_n(&_r, __ATOMIC_RELAXED);
+        return __atomic_load_n(&_w, __ATOMIC_ACQUIRE) - r;
     }
 
     bool get(T* p)
     {
-        int r = _r;
-        if (r == _w) // !readable()
+        unsigned r = __atomic_load_n(&_r, __ATOMIC_RELAXED);
+        if (r == __atomic_load_n(&_w, __ATOMIC_ACQUIRE)) // !readable()
             return false;
-        *p = _b[r];
-        _r = _inc(r);
+        *p = _b[r & MASK];
+        __atomic_store_n(&_r, r + 1, __ATOMIC_RELEASE);
         return true;
     }
 
     bool peek(T* p)
     {
-        int r = _r;
-        if (r == _w) // !readable()
+        unsigned r = __atomic_load_n(&_r, __ATOMIC_RELAXED);
+        if (r == __atomic_load_n(&_w, __ATOMIC_ACQUIRE)) // !readable()
             return false;
-        *p = _b[r];
+        *p = _b[r & MASK];
+        return true;
+    }
+
+    // Element i places behind the oldest one, left in place
+    bool peek(T* p, unsigned i)
+    {
+        unsigned r = __atomic_load_n(&_r, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&_w, __ATOMIC_ACQUIRE) - r <= i)
+            return false;
+        *p = _b[(r + i) & MASK];
         return true;
     }
 
@@ -150,27 +191,42 @@ public:
             }
             // check available data
             if (c < f) f = c;
-            int r = _r;
-            int m = N - r;
+            unsigned r = __atomic_load_n(&_r, __ATOMIC_RELAXED);
+            int m = N - (r & MASK);
             // check wrap
             if (f > m) f = m;
-            memcpy(p, &_b[r], f);
-            _r = _inc(r, f);
+            memcpy(p, &_b[r & MASK], f * sizeof(T));
+            __atomic_store_n(&_r, r + f, __ATOMIC_RELEASE);
             c -= f;
             p += f;
         }
         return n - c;
     }
 
-private:
-    int _inc(int i, int n = 1)
+    // Zero copy read: returns the number of contiguous readable slots at *p,
+    // release them with consume(). Like reserveContiguous() data wrapping
+    // around the end is returned by a second call.
+    size_t peekContiguous(T** p)
+    {
+        unsigned r = __atomic_load_n(&_r, __ATOMIC_RELAXED);
+        unsigned s = __atomic_load_n(&_w, __ATOMIC_ACQUIRE) - r;
+        unsigned m = N - (r & MASK);
+        *p = &_b[r & MASK];
+        return (s > m) ? m : s;
+    }
+
+    void consume(size_t n)
     {
-        return (i + n) % N;
+        unsigned r = __atomic_load_n(&_r, __ATOMIC_RELAXED);
+        __atomic_store_n(&_r, r + (unsigned)n, __ATOMIC_RELEASE);
     }
 
-    T    _b[N];
-    int  _w;
-    int  _r;
+private:
+    enum { MASK = N - 1 };
+
+    T         _b[N];
+    unsigned  _w; // written by the producer only
+    unsigned  _r; // written by the consumer only
 };
 
 #ifndef YIELD
@@ -211,10 +267,136 @@ const T& Max(const T& a, const T& b)
     return (b < a) ? a : b;
 }
 
+// default FIFO sizes of LoRaModem, must be powers of two, see SerialFifo
 #if !defined(LORA_RX_BUFFER)
   #define LORA_RX_BUFFER 256
 #endif
 
+#if !defined(LORA_TX_BUFFER)
+  #define LORA_TX_BUFFER 256
+#endif
+
+#if !defined(LORA_LINE_BUFFER)
+  #define LORA_LINE_BUFFER 48
+#endif
+
+// Trie nodes of the response matcher, 5 bytes each. The largest set armed,
+// the uplink answers plus +RECV=, takes 57.
+#if !defined(LORA_MATCHER_NODES)
+  #define LORA_MATCHER_NODES 64
+#endif
+
+/*
+ * Multi-pattern matcher (Aho-Corasick) used by waitResponse() to look for
+ * all the candidate responses at once. Every byte moves the automaton by one
+ * state and the index of the matching pattern is read from that state, so the
+ * cost per byte does not depend on the number of candidates.
+ * When several patterns end on the same byte the lowest index wins, exactly
+ * like the r1..r8 order of the former endsWith() chain.
+ */
+class ResponseMatcher
+{
+public:
+    ResponseMatcher()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        _n[0].c = 0;
+        _n[0].child = 0;
+        _n[0].sibling = 0;
+        _n[0].fail = 0;
+        _n[0].out = 0;
+        _count = 1;
+        _state = 0;
+    }
+
+    bool add(const char* p, int8_t index)
+    {
+        if (!p || !*p) return false;
+        uint8_t s = 0;
+        for (; *p; p++) {
+            uint8_t n = _child(s, *p);
+            if (!n) {
+                if (_count >= LORA_MATCHER_NODES) return false;
+                n = _count++;
+                _n[n].c = *p;
+                _n[n].child = 0;
+                _n[n].sibling = _n[s].child;
+                _n[n].fail = 0;
+                _n[n].out = 0;
+                _n[s].child = n;
+            }
+            s = n;
+        }
+        if (!_n[s].out) _n[s].out = index;
+        return true;
+    }
+
+    // Builds the failure links; must be called after the last add().
+    void compile()
+    {
+        // nodes are numbered in insertion order, not breadth-first,
+        // so walk the trie level by level using a small queue
+        uint8_t queue[LORA_MATCHER_NODES];
+        uint8_t head = 0, tail = 0;
+        for (uint8_t n = _n[0].child; n; n = _n[n].sibling) {
+            _n[n].fail = 0;
+            queue[tail++] = n;
+        }
+        while (head < tail) {
+            uint8_t s = queue[head++];
+            for (uint8_t n = _n[s].child; n; n = _n[n].sibling) {
+                uint8_t f = _n[s].fail;
+                while (f && !_child(f, _n[n].c)) f = _n[f].fail;
+                _n[n].fail = _child(f, _n[n].c);
+                int8_t o = _n[_n[n].fail].out;
+                if (o && (!_n[n].out || o < _n[n].out)) _n[n].out = o;
+                queue[tail++] = n;
+            }
+        }
+        _state = 0;
+    }
+
+    void reset()
+    {
+        _state = 0;
+    }
+
+    // Feeds one byte, returns the index of the pattern ending here or 0
+    int8_t feed(char c)
+    {
+        uint8_t s = _state;
+        uint8_t n;
+        while (!(n = _child(s, c)) && s) s = _n[s].fail;
+        _state = n;
+        return _n[n].out;
+    }
+
+private:
+    uint8_t _child(uint8_t s, char c)
+    {
+        for (uint8_t n = _n[s].child; n; n = _n[n].sibling) {
+            if (_n[n].c == c) return n;
+        }
+        return 0;
+    }
+
+    struct Node {
+        char    c;
+        uint8_t child;
+        uint8_t sibling;
+        uint8_t fail;
+        int8_t  out;
+    };
+
+    Node    _n[LORA_MATCHER_NODES];
+    uint8_t _count;
+    uint8_t _state;
+};
+
 #define LORA_NL "\r"
 static const char LORA_OK[] = "+OK";
 static const char LORA_ERROR[] = "+ERR\r";
@@ -224,6 +406,8 @@ static const char LORA_ERROR_OVERFLOW[] = "+ERR_PARAM_OVERFLOW\r";
 static const char LORA_ERROR_NO_NETWORK[] = "+ERR_NO_NETWORK\r";
 static const char LORA_ERROR_RX[] = "+ERR_RX\r";
 static const char LORA_ERROR_UNKNOWN[] = "+ERR_UNKNOWN\r";
+static const char LORA_RECV[] = "+RECV=";
+#define LORA_RECV_INDEX 99
 
 static const char ARDUINO_FW_VERSION[] = "ARD-078 1.2.1";
 static const char ARDUINO_FW_IDENTIFIER[] = "ARD-078";
@@ -267,44 +451,657 @@ typedef enum {
     CLASS_C,
 } _lora_class;
 
-class LoRaModem : public Stream
+// Completion handler of an asynchronous command, result is the same as
+// commandStatus(): index of the matched response (1 = OK) or -1 on timeout
+typedef void (*LoRaCommandCallback)(uint8_t handle, int8_t result);
+
+#define LORA_ASYNC_PENDING 0
+#define LORA_ASYNC_TIMEOUT (-1)
+#define LORA_ASYNC_UNKNOWN (-2)
+
+#if !defined(LORA_ASYNC_HISTORY)
+  #define LORA_ASYNC_HISTORY 4
+#endif
+
+#if !defined(LORA_BATCH_BUFFER)
+  #define LORA_BATCH_BUFFER 128
+#endif
+
+#if !defined(LORA_BATCH_COMMANDS)
+  #define LORA_BATCH_COMMANDS 8
+#endif
+
+// Bytes of commands sent ahead of their response, must fit the modem UART buffer
+#if !defined(LORA_PIPELINE_WINDOW)
+  #define LORA_PIPELINE_WINDOW 64
+#endif
+
+/*
+ * A list of AT commands sent back to back by LoRaModem::sendBatch().
+ * Only commands answered with "+OK" or "+ERR..." (setters) can be batched.
+ */
+class LoRaCommandBatch : public Print
+{
+public:
+    LoRaCommandBatch()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        _len = 0;
+        _count = 0;
+        _overflow = false;
+    }
+
+    // Same arguments as sendAT(), e.g. add(GF("+DR="), 3)
+    template<typename... Args>
+    bool add(Args... cmd)
+    {
+        if (_count >= LORA_BATCH_COMMANDS) return false;
+        size_t start = _len;
+        print("AT");
+        addParts(cmd...);
+        print(LORA_NL);
+        if (_overflow) {
+            _len = start;
+            _overflow = false;
+            return false;
+        }
+        _end[_count] = _len;
+        _status[_count++] = LORA_ASYNC_PENDING;
+        return true;
+    }
+
+    int count() { return _count; }
+
+    // Index of the response received for command i: 1 for "+OK", 2 and above
+    // for the errors in modemSend() order, LORA_ASYNC_TIMEOUT if none came
+    int8_t status(int i) { return (i >= 0 && i < _count) ? _status[i] : LORA_ASYNC_UNKNOWN; }
+
+    size_t write(uint8_t c)
+    {
+        if (_len >= LORA_BATCH_BUFFER) {
+            _overflow = true;
+            return 0;
+        }
+        _buf[_len++] = c;
+        return 1;
+    }
+    using Print::write;
+
+private:
+    template<unsigned RxN, unsigned TxN> friend class BasicLoRaModem;
+
+    void addParts() {}
+
+    template<typename T, typename... Args>
+    void addParts(T head, Args... tail)
+    {
+        print(head);
+        addParts(tail...);
+    }
+
+    size_t start(int i) { return i ? _end[i - 1] : 0; }
+
+    char     _buf[LORA_BATCH_BUFFER];
+    uint16_t _end[LORA_BATCH_COMMANDS];
+    int8_t   _status[LORA_BATCH_COMMANDS];
+    uint8_t  _count;
+    uint16_t _len;
+    bool     _overflow;
+};
+
+#define LORA_MAX_CHANNELS 96
+
+/*
+ * Local copy of the modem channel mask (six 16 bit words, channel 0 is bit 0
+ * of the first word), edited in RAM and written with a single +CHANMASK= by
+ * LoRaModem::commitChannelMask(). Only masks that changed are written.
+ */
+class LoRaChannelMask
+{
+public:
+    LoRaChannelMask()
+    {
+        memset(_words, 0, sizeof(_words));
+        _dirty = false;
+    }
+
+    bool isEnabled(int ch)
+    {
+        if (ch < 0 || ch >= LORA_MAX_CHANNELS) return false;
+        return (_words[ch / 16] >> (ch % 16)) & 1;
+    }
+
+    void enable(int ch)
+    {
+        setRange(ch, ch, true);
+    }
+
+    void disable(int ch)
+    {
+        setRange(ch, ch, false);
+    }
+
+    // Enables (or disables) channels first to last, both included
+    void setRange(int first, int last, bool on = true)
+    {
+        if (first < 0) first = 0;
+        if (last >= LORA_MAX_CHANNELS) last = LORA_MAX_CHANNELS - 1;
+        for (int ch = first; ch <= last; ch++) {
+            uint16_t bit = (uint16_t)(1 << (ch % 16));
+            uint16_t w = on ? (_words[ch / 16] | bit) : (_words[ch / 16] & ~bit);
+            if (w != _words[ch / 16]) {
+                _words[ch / 16] = w;
+                _dirty = true;
+            }
+        }
+    }
+
+    void enableAll()
+    {
+        setRange(0, LORA_MAX_CHANNELS - 1, true);
+    }
+
+    void disableAll()
+    {
+        setRange(0, LORA_MAX_CHANNELS - 1, false);
+    }
+
+    // US915/AU915 sub-band n (1 to 8): 125 kHz channels 8*(n-1) to 8*n-1
+    // and the 500 kHz channel 64+(n-1)
+    void enableSubBand(int n, bool on = true)
+    {
+        if (n < 1 || n > 8) return;
+        setRange(8 * (n - 1), 8 * n - 1, on);
+        setRange(64 + n - 1, 64 + n - 1, on);
+    }
+
+    void disableSubBand(int n)
+    {
+        enableSubBand(n, false);
+    }
+
+    // Leaves only sub-band n enabled, as most US915 networks expect
+    void selectSubBand(int n)
+    {
+        disableAll();
+        enableSubBand(n);
+    }
+
+    uint16_t word(int i)
+    {
+        return _words[i];
+    }
+
+    bool dirty()
+    {
+        return _dirty;
+    }
+
+private:
+    template<unsigned RxN, unsigned TxN> friend class BasicLoRaModem;
+
+    uint16_t _words[LORA_MAX_CHANNELS / 16];
+    bool     _dirty;
+};
+
+// How LoRaModem waits for the module, see setWaitStrategy()
+typedef enum {
+    LORA_WAIT_DELAY = 0, // YIELD(), delay(2) unless redefined (default)
+    LORA_WAIT_BUSY,      // poll continuously
+    LORA_WAIT_YIELD,     // yield() to the scheduler / other tasks
+    LORA_WAIT_SLEEP,     // sleep until the next interrupt (WFI)
+    LORA_WAIT_CALLBACK,  // call a user function
+} _lora_wait;
+
+// Time spent by the modem calls, in microseconds
+typedef struct {
+    uint32_t commands;     // completed responses
+    uint32_t total_us;     // time spent in commands
+    uint32_t idle_us;      // part of it spent in the wait strategy
+    uint32_t last_us;      // last command
+    uint32_t last_idle_us;
+} LoRaWaitStats;
+
+// Modem parameters kept in RAM by LoRaModem, see invalidateCache()
+typedef enum {
+    LORA_CACHE_MSIZE    = 1 << 0,
+    LORA_CACHE_DR       = 1 << 1,
+    LORA_CACHE_ADR      = 1 << 2,
+    LORA_CACHE_RX2DR    = 1 << 3,
+    LORA_CACHE_RX2FQ    = 1 << 4,
+    LORA_CACHE_CHANMASK = 1 << 5,
+    LORA_CACHE_DEVADDR  = 1 << 6,
+    LORA_CACHE_VERSION  = 1 << 7,
+    LORA_CACHE_ALL      = 0xFF,
+} _lora_cache;
+
+typedef struct {
+    uint32_t hits;   // AT queries saved
+    uint32_t misses; // AT queries sent
+} LoRaCacheStats;
+
+// Numeric parameters set with "AT+<name>=<value>" and read back with
+// "AT+<name>?", see LORA_PARAMS. Cached ones come first.
+typedef enum {
+    LORA_PARAM_DR = 0,
+    LORA_PARAM_ADR,
+    LORA_PARAM_RX2DR,
+    LORA_PARAM_RX2FQ,
+    LORA_PARAM_FCU,
+    LORA_PARAM_FCD,
+    LORA_PARAM_PORT,
+    LORA_PARAM_NWK,
+    LORA_PARAM_SLEEP,
+    LORA_PARAM_DFORMAT,
+    LORA_PARAM_DUTYCYCLE,
+} _lora_param;
+
+#define LORA_PARAM_CACHED   (LORA_PARAM_RX2FQ + 1)
+
+typedef struct {
+    const char* name;       // AT command without the '+'
+    uint8_t     cache;      // _lora_cache bit holding the value, 0 if none
+    uint8_t     depends;    // cached values to drop when it changes
+} LoRaParam;
+
+static const LoRaParam LORA_PARAMS[] = {
+    { "DR",        LORA_CACHE_DR,    LORA_CACHE_MSIZE },  // max payload follows the data rate
+    { "ADR",       LORA_CACHE_ADR,   0 },
+    { "RX2DR",     LORA_CACHE_RX2DR, 0 },
+    { "RX2FQ",     LORA_CACHE_RX2FQ, 0 },
+    { "FCU",       0,                0 },
+    { "FCD",       0,                0 },
+    { "PORT",      0,                0 },
+    { "NWK",       0,                0 },
+    { "SLEEP",     0,                0 },
+    { "DFORMAT",   0,                0 },
+    { "DUTYCYCLE", 0,                0 },
+};
+
+// Uplink queue, see enqueue() and processQueue(). It takes LORA_UPLINK_QUEUE
+// * (LORA_UPLINK_PAYLOAD + 8) bytes and more for its statistics, so it is
+// left out unless LORA_UPLINK_QUEUE is defined non zero before including
+// MKRWAN.h. sendFragmented() goes through it too.
+#if !defined(LORA_UPLINK_QUEUE)
+  #define LORA_UPLINK_QUEUE 0    // frames
+#endif
+
+#if !defined(LORA_UPLINK_PAYLOAD)
+  #define LORA_UPLINK_PAYLOAD 64 // bytes per frame
+#endif
+
+#if !defined(LORA_UPLINK_RETRY)
+  #define LORA_UPLINK_RETRY 2000 // ms before the first retry, doubled after each
+#endif
+
+// From the end of an uplink to its second receive window, LoRaWAN RECEIVE_DELAY2
+#if !defined(LORA_RX2_DELAY)
+  #define LORA_RX2_DELAY 2000    // ms
+#endif
+
+#if !defined(LORA_RETRY_ATTEMPTS)
+  #define LORA_RETRY_ATTEMPTS 8  // attempts per frame
+#endif
+
+// Errors retried by default, bit n for the -n returned by endPacket():
+// timeout, +ERR_BUSY, +ERR_NO_NETWORK, +ERR_RX and +ERR_UNKNOWN
+#define LORA_RETRY_DEFAULT ((1 << 1) | (1 << 4) | (1 << 6) | (1 << 7) | (1 << 8))
+
+#define LORA_HISTOGRAM 8
+
+typedef struct {
+    uint32_t queued;       // frames accepted by enqueue()
+    uint32_t sent;
+    uint32_t dropped;      // rejected because the queue was full, or failed
+    uint32_t retries;      // +ERR_BUSY from the modem
+    uint8_t  depth;        // frames waiting now
+    uint8_t  max_depth;
+    uint32_t total_wait_ms; // enqueue to transmission, over the sent frames
+    uint32_t max_wait_ms;
+} LoRaQueueStats;
+
+// Outcome of the confirmed frames of the uplink queue, see setRetryPolicy()
+typedef struct {
+    uint32_t delivered;
+    uint32_t failed;                   // dropped after an error or the last attempt
+    uint32_t errors[9];                // per attempt: [n] for endPacket() = -n, [0] too long
+    uint32_t attempts[LORA_HISTOGRAM]; // [n] delivered at attempt n + 1, last one and more
+    uint32_t latency[LORA_HISTOGRAM];  // [0] below 1 s, [n] below 2^n s, last one and more
+} LoRaDeliveryStats;
+
+// Command families instrumented when LORA_STATS is defined, see statsSnapshot()
+typedef enum {
+    LORA_CMD_UTX = 0,
+    LORA_CMD_CTX,
+    LORA_CMD_JOIN,
+    LORA_CMD_CHANMASK,
+    LORA_CMD_SET,        // other "+X=" setters
+    LORA_CMD_GET,        // other "+X?" getters
+    LORA_CMD_BATCH,      // sendBatch(), one call for all its commands
+    LORA_CMD_OTHER,
+    LORA_CMD_FAMILIES
+} _lora_cmd_family;
+
+#if defined(LORA_STATS)
+// Commands of the first families, in the same order
+static const char* const LORA_CMD_NAMES[] = { "UTX", "CTX", "JOIN", "CHANMASK" };
+#endif
+
+// Round trip histogram: [0] below 1 ms, [n] below 2^n ms, last one and more
+#define LORA_STATS_BUCKETS 16
+
+typedef struct {
+    uint32_t count;
+    uint32_t timeouts;
+    uint32_t responses[8];   // [n - 1]: answered with response n, +OK is 1 and +ERR_* follow
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t avg_us;         // filled in by statsSnapshot()
+    uint32_t p99_us;         // same, upper bound of the histogram bucket
+    uint64_t total_us;
+    uint16_t histogram[LORA_STATS_BUCKETS];
+} LoRaCommandStats;
+
+typedef struct {
+    LoRaCommandStats family[LORA_CMD_FAMILIES];
+    uint32_t unhandled_bytes; // received while waiting, matching no response
+} LoRaStatsSnapshot;
+
+// Downlinks are queued in rx as records: port, length, millis() (4 bytes)
+// then the payload
+#define LORA_RECORD_HEADER 6
+
+typedef struct {
+    uint32_t received;
+    uint32_t dropped;    // no room left in rx
+    uint32_t truncated;  // payload cut short by the module, padded with 0
+} LoRaDownlinkStats;
+
+// Downlink handler, payload is only valid for the duration of the call
+typedef void (*LoRaReceiveCallback)(uint8_t port, const uint8_t* payload, size_t len);
+
+#if defined(LORA_TRACE)
+// Passes what the modem sends to the module on, recording it in the trace
+class LoRaTraceTap : public Print
+{
+public:
+    LoRaTraceTap(Print& out, LoRaTrace<LORA_TRACE_BUFFER>& trace) : _out(out), _trace(trace) {}
+
+    size_t write(uint8_t c)
+    {
+        _trace.add(LORA_TRACE_TX, c, micros());
+        return _out.write(c);
+    }
+
+    size_t write(const uint8_t* buffer, size_t size)
+    {
+        _trace.add(LORA_TRACE_TX, buffer, size, micros());
+        return _out.write(buffer, size);
+    }
+
+private:
+    Print& _out;
+    LoRaTrace<LORA_TRACE_BUFFER>& _trace;
+};
+#endif
+
+/*
+ * Plays a trace from LoRaModem::dumpTrace() back as the module, e.g. to run
+ * the parser on a host against a recorded session. Bytes the module sent
+ * become readable once the modem wrote everything it sent before them and,
+ * when timed, once as much time passed as in the recording; otherwise the
+ * trace is replayed as fast as the modem reads it. What the modem writes is
+ * compared with the trace.
+ */
+class LoRaTraceReplay : public Stream
+{
+public:
+    LoRaTraceReplay(const uint8_t* trace, size_t len, bool timed = false)
+      : _trace(trace), _len(len), _timed(timed)
+    {
+        rewind();
+    }
+
+    void rewind()
+    {
+        LoRaTraceReader first(_trace, _len);
+        _t0 = first.next() ? first.time() : 0;
+        _start = micros();
+        _rx.begin(_trace, _len);
+        _rx.next(LORA_TRACE_RX);
+        _tx.begin(_trace, _len);
+        _tx.next(LORA_TRACE_TX);
+        _rx_off = 0;
+        _tx_off = 0;
+        _mismatches = 0;
+    }
+
+    // True once the modem read all the bytes the module sent
+    bool done()
+    {
+        available();
+        return !_rx.size();
+    }
+
+    // Bytes written that differ from the trace, or past its end
+    uint32_t mismatches()
+    {
+        return _mismatches;
+    }
+
+    int available()
+    {
+        if (_rx.size() && _rx_off == _rx.size()) {
+            _rx.next(LORA_TRACE_RX);
+            _rx_off = 0;
+        }
+        if (!_rx.size() || _tx.offset() < _rx.offset()) {
+            return 0;
+        }
+        if (_timed && micros() - _start < _rx.time() - _t0) {
+            return 0;
+        }
+        return _rx.size() - _rx_off;
+    }
+
+    int read()
+    {
+        return available() ? _rx.data()[_rx_off++] : -1;
+    }
+
+    int peek()
+    {
+        return available() ? _rx.data()[_rx_off] : -1;
+    }
+
+    void flush() {}
+
+    size_t write(uint8_t c)
+    {
+        if (!_tx.size()) {
+            _mismatches++;
+            return 1;
+        }
+        if (_tx.data()[_tx_off] != c) {
+            _mismatches++;
+        }
+        if (++_tx_off == _tx.size()) {
+            _tx.next(LORA_TRACE_TX);
+            _tx_off = 0;
+        }
+        return 1;
+    }
+    using Print::write;
+
+private:
+    const uint8_t*  _trace;
+    size_t          _len;
+    bool            _timed;
+    uint32_t        _t0;
+    unsigned long   _start;
+    LoRaTraceReader _rx;
+    LoRaTraceReader _tx;
+    size_t          _rx_off;
+    size_t          _tx_off;
+    uint32_t        _mismatches;
+};
+
+/*
+ * RxN and TxN size the downlink and uplink FIFOs, see LoRaModem for the
+ * defaults. A node that never receives downlinks can use a few bytes for
+ * RxN; TxN only needs to hold the largest payload the region and data rate
+ * allow (64 bytes with the ARD-078 firmware, 242 for LoRaWAN at most).
+ */
+template<unsigned RxN, unsigned TxN>
+class BasicLoRaModem : public Stream
 {
+  static_assert(TxN <= 256, "no LoRaWAN uplink exceeds 242 bytes");
+  static_assert(RxN >= LORA_RECORD_HEADER, "rx holds at least a downlink header");
 
 public:
-  LoRaModem(__attribute__((unused)) Stream& stream = (Stream&)Serial)
+  BasicLoRaModem(__attribute__((unused)) Stream& stream = (Stream&)Serial)
 #ifdef SerialLoRa
     : stream(SerialLoRa), lastPollTime(millis()), pollInterval(300000)
 #else
     : stream(stream), lastPollTime(millis()), pollInterval(300000)
 #endif
-    {}
+    , downlinkPort(0), msg_left(0), msg_time(0)
+    , direct_buf(NULL), direct_len(0), receiveCallback(NULL)
+    , unhandled(0), async_pending(false), async_join(false)
+    , async_uplink(false), async_handle(0)
+    , async_next(0), async_result(LORA_ASYNC_UNKNOWN), async_callback(NULL)
+    , wait_mode(LORA_WAIT_DELAY), wait_callback(NULL), call_open(false)
+    , cache_valid(0), cache_msize(0), duty_enabled(true), band_start(0), band_silence(0), duty_window(0)
+    , duty_used(0), tx_airtime(0)
+#if LORA_UPLINK_QUEUE
+    , uplink_head(0), uplink_late(false), retry_attempts(LORA_RETRY_ATTEMPTS)
+    , retry_backoff(LORA_UPLINK_RETRY), retry_mask(LORA_RETRY_DEFAULT)
+    , frag_buf(NULL), frag_id(0)
+#endif
+#if defined(LORA_TRACE)
+    , trace_tap(this->stream, trace)
+#endif
+    {
+#if LORA_UPLINK_QUEUE
+      memset(&delivery_stats, 0, sizeof(delivery_stats));
+      memset(&queue_stats, 0, sizeof(queue_stats));
+#endif
+      memset(&downlink_stats, 0, sizeof(downlink_stats));
+      resetStats();
+      memset(&cache_stats, 0, sizeof(cache_stats));
+      memset(cache_param, 0, sizeof(cache_param));
+      resetWaitStats();
+      memset(async_done, 0, sizeof(async_done));
+      memset(matcher_keys, 0, sizeof(matcher_keys));
+      fw_version[0] = '\0';
+      line[0] = '\0';
+    }
 
 public:
-  typedef SerialFifo<uint8_t, LORA_RX_BUFFER> RxFifo;
+  typedef SerialFifo<uint8_t, RxN> RxFifo;
+  typedef SerialFifo<uint8_t, TxN> TxFifo;
 
 private:
   Stream&       stream;
   bool          network_joined;
   RxFifo        rx;
-  RxFifo        tx;
-  String        fw_version;
+  TxFifo        tx;
+  char          fw_version[LORA_LINE_BUFFER];
   unsigned long lastPollTime;
   unsigned long pollInterval;
   uint8_t       downlinkPort; // Valid values are between 1 and 223
+  size_t        msg_left;     // bytes of the current downlink still in rx
+  unsigned long msg_time;
+  LoRaDownlinkStats downlink_stats;
+  uint8_t*      direct_buf;   // read() destination while it waits for a downlink
+  size_t        direct_len;
+  LoRaReceiveCallback receiveCallback;
   int           mask_size;
   uint16_t      channelsMask[6];
-  String        channel_mask_str;
   _lora_band    region;
+  ResponseMatcher matcher;
+  ConstStr      matcher_keys[8];
+  char          line[LORA_LINE_BUFFER]; // response line, shared by all the parsers
+  size_t        unhandled;    // bytes of line not matched yet
+  // asynchronous command engine, a single command is in flight at a time
+  bool          async_pending;
+  bool          async_join;
+  bool          async_uplink;
+  uint8_t       async_handle; // 0 for blocking calls
+  uint8_t       async_next;
+  int8_t        async_result;
+  unsigned long async_start;
+  uint32_t      async_timeout;
+  LoRaCommandCallback async_callback;
+  struct {
+    uint8_t handle;
+    int8_t  result;
+  }             async_done[LORA_ASYNC_HISTORY]; // last completed commands
+  _lora_wait    wait_mode;
+  void          (*wait_callback)(void);
+  LoRaWaitStats wait_stats;
+  bool          call_open;
+  unsigned long call_start;
+  uint32_t      call_idle;
+#if defined(LORA_STATS)
+  LoRaStatsSnapshot stats;
+  uint8_t       stats_family;
+#endif
+  // cached modem parameters, valid when their _lora_cache bit is set
+  uint8_t       cache_valid;
+  LoRaCacheStats cache_stats;
+  size_t        cache_msize;
+  uint32_t      cache_param[LORA_PARAM_CACHED];
+  char          cache_devaddr[12];
+  // duty cycle of the current band and uplink queue
+  bool          duty_enabled;
+  uint32_t      band_start;   // millis() at which the band went silent
+  uint32_t      band_silence; // for that many ms, 0 once it is over
+  unsigned long duty_window;  // start of the current hour
+  uint32_t      duty_used;    // airtime spent in it, in ms
+  uint32_t      tx_airtime;   // estimate for the frame being sent, in ms
+#if LORA_UPLINK_QUEUE
+  struct {
+    uint8_t       len;
+    bool          confirmed;
+    uint8_t       attempts;
+    bool          timed_out;  // last attempt not answered, its answer may still come
+    unsigned long queued;
+    uint8_t       data[LORA_UPLINK_PAYLOAD];
+  }             uplinks[LORA_UPLINK_QUEUE];
+  uint8_t       uplink_head;
+  bool          uplink_late;  // an uplink timed out, its answer was not read yet
+  LoRaQueueStats queue_stats;
+  uint8_t       retry_attempts;
+  uint32_t      retry_backoff;
+  uint16_t      retry_mask;
+  LoRaDeliveryStats delivery_stats;
+  // message being split by sendFragmented()
+  const uint8_t* frag_buf;
+  size_t        frag_len;
+  size_t        frag_off;
+  uint8_t       frag_index;
+  uint8_t       frag_id;
+  bool          frag_confirmed;
+#endif
+#if defined(LORA_TRACE)
+  // UART traffic, see dumpTrace()
+  LoRaTrace<LORA_TRACE_BUFFER> trace;
+  LoRaTraceTap  trace_tap;
+#endif
 
 public:
   virtual int joinOTAA(const char *appEui, const char *appKey, const char *devEui, uint32_t timeout) {
-    YIELD();
-    rx.clear();
-    changeMode(OTAA);
-    set(APP_EUI, appEui);
-    set(APP_KEY, appKey);
-    if (devEui != NULL) {
-        set(DEV_EUI, devEui);
+    idle();
+    clearDownlinks();
+    // never join with keys the module did not take
+    if (!configureOTAA(appEui, appKey, devEui)) {
+      network_joined = false;
+      return false;
     }
     network_joined = join(timeout);
     delay(1000);
@@ -320,13 +1117,18 @@ public:
   }
 
   virtual int joinABP(/*const char* nwkId, */const char * devAddr, const char * nwkSKey, const char * appSKey, uint32_t timeout = DEFAULT_JOIN_TIMEOUT) {
-    YIELD();
-    rx.clear();
-    changeMode(ABP);
-    //set(NWK_ID, nwkId);
-    set(DEV_ADDR, devAddr);
-    set(NWKS_KEY, nwkSKey);
-    set(APPS_KEY, appSKey);
+    idle();
+    clearDownlinks();
+    LoRaCommandBatch batch;
+    batch.add(GF("+MODE="), ABP);
+    //batch.add(GF("+IDNWK="), nwkId);
+    batch.add(GF("+DEVADDR="), devAddr);
+    batch.add(GF("+NWKSKEY="), nwkSKey);
+    batch.add(GF("+APPSKEY="), appSKey);
+    if (!sendBatchChecked(batch)) {
+      network_joined = false;
+      return false;
+    }
     network_joined = join(timeout);
     return (getJoinStatus() == 1);
   }
@@ -341,60 +1143,325 @@ public:
   }
 
   int endPacket(bool confirmed = false) {
-    uint8_t buffer[LORA_RX_BUFFER];
-    memset(buffer, 0, LORA_RX_BUFFER);
-    int size = tx.get(buffer, tx.size());
-    return modemSend(buffer, size, confirmed);
+    size_t len = tx.size();
+    if (len > modemGetMaxSize()) {
+      tx.clear();
+      return -20;
+    }
+    modemSendHeader(len, confirmed);
+    // stream the payload straight out of the ring, at most two spans
+    uint8_t* p;
+    size_t n;
+    while ((n = tx.peekContiguous(&p)) > 0) {
+      txStream().write(p, n);
+      tx.consume(n);
+    }
+    return modemSendResult(len, confirmed);
   }
 
-  size_t write(uint8_t c) {
-    return tx.put(c);
-  };
-
-  size_t write(const uint8_t *buffer, size_t size) {
-    return tx.put(buffer, size);
-  };
-
-  template <typename T> inline size_t write(T val) {return write((uint8_t*)&val, sizeof(T));};
-  using Print::write;
-
-  int parsePacket() {
-    return available();
+#if LORA_UPLINK_QUEUE
+  /*
+   * Uplink queue: frames are stored without blocking and transmitted by
+   * processQueue() as soon as the duty cycle of the band allows it, in
+   * order. When the queue is full the new frame is dropped.
+   */
+  bool enqueue(const void* buff, size_t len, bool confirmed = false) {
+    if (len > LORA_UPLINK_PAYLOAD || queue_stats.depth == LORA_UPLINK_QUEUE) {
+      queue_stats.dropped++;
+      return false;
+    }
+    uint8_t i = (uplink_head + queue_stats.depth) % LORA_UPLINK_QUEUE;
+    uplinks[i].len = len;
+    uplinks[i].confirmed = confirmed;
+    uplinks[i].queued = millis();
+    uplinks[i].attempts = 0;
+    uplinks[i].timed_out = false;
+    memcpy(uplinks[i].data, buff, len);
+    queue_stats.queued++;
+    if (++queue_stats.depth > queue_stats.max_depth) {
+      queue_stats.max_depth = queue_stats.depth;
+    }
+    return true;
   }
 
-  virtual int available() {
-    YIELD();
-    if (!rx.size()) {
-      maintain();
+  // Queues the packet written since beginPacket() instead of sending it
+  bool queuePacket(bool confirmed = false) {
+    uint8_t buff[LORA_UPLINK_PAYLOAD];
+    size_t len = tx.size();
+    if (len > sizeof(buff)) {
+      tx.clear();
+      queue_stats.dropped++;
+      return false;
     }
-    return rx.size(); // + buf_available;
+    tx.get(buff, len);
+    return enqueue(buff, len, confirmed);
   }
 
-  virtual int read(uint8_t *buf, size_t size) {
-    YIELD();
-    maintain();
-    size_t cnt = 0;
-    while (cnt < size) {
-      size_t chunk = Min(size-cnt, rx.size());
-      if (chunk > 0) {
-        rx.get(buf, chunk);
-        buf += chunk;
-        cnt += chunk;
-        continue;
+  /*
+   * Sends a message of any size as fragments of the current maximum payload,
+   * each with a LORA_FRAGMENT_HEADER byte (see LoRaFragment.h), through the
+   * uplink queue. buff must stay valid until fragmentsPending() is false.
+   * One message at a time.
+   */
+  bool sendFragmented(const void* buff, size_t len, bool confirmed = false) {
+    size_t count = fragmentCount(len);
+    if (frag_buf || !count || count > LORA_FRAGMENT_MAX) {
+      return false;
+    }
+    frag_buf = (const uint8_t*)buff;
+    frag_len = len;
+    frag_off = 0;
+    frag_index = 0;
+    frag_id = (frag_id + 1) & 3;
+    frag_confirmed = confirmed;
+    queueFragments();
+    return true;
+  }
+
+  bool fragmentsPending() {
+    return frag_buf != NULL;
+  }
+
+  // Fragments needed for len bytes at the current data rate, 0 if unknown
+  size_t fragmentCount(size_t len) {
+    size_t room = Min(modemGetMaxSize(), (size_t)LORA_UPLINK_PAYLOAD);
+    if (room <= LORA_FRAGMENT_HEADER) {
+      return 0;
+    }
+    room -= LORA_FRAGMENT_HEADER;
+    return (len + room - 1) / room;
+  }
+
+  // Sends the next frame if the band is free, returns the frames left
+  int processQueue() {
+    queueFragments();
+    if (!queue_stats.depth || async_pending || nextTransmit()) {
+      return queue_stats.depth;
+    }
+    uint8_t i = uplink_head;
+    // the answer to an uplink that timed out may have come since: take it
+    // out of the way of the next command
+    int8_t late = uplink_late ? lateUplinkResult() : 0;
+    uplink_late = false;
+    int rc;
+    if (late && uplinks[i].timed_out) {
+      // the attempt was answered after all: settle it rather than send again
+      delivery_stats.errors[1]--;
+      queue_stats.retries--;
+      rc = (late == 1) ? uplinks[i].len : -late;
+    } else {
+      rc = modemSend(uplinks[i].data, uplinks[i].len, uplinks[i].confirmed);
+      uplinks[i].attempts++;
+      uplink_late = (rc == -1);
+    }
+    uplinks[i].timed_out = false;
+    if (rc < 0) {
+      uint8_t err = (rc < -8) ? 0 : -rc;
+      delivery_stats.errors[err]++;
+      // +ERR_BUSY: not sent, the modem keeps its own duty cycle accounting
+      bool retry = (rc == -4) || (uplinks[i].confirmed && (retry_mask & (1 << err)));
+      if (retry && uplinks[i].attempts < retry_attempts) {
+        queue_stats.retries++;
+        uplinks[i].timed_out = (rc == -1);
+        // exponential backoff, counted from the end of the duty cycle silence
+        uint8_t shift = Min(uplinks[i].attempts - 1, 6);
+        band_silence = nextTransmit() + (retry_backoff << shift);
+        band_start = millis();
+        return queue_stats.depth;
+      }
+      queue_stats.dropped++;
+      if (uplinks[i].confirmed) {
+        delivery_stats.failed++;
+      }
+    } else {
+      uint32_t wait = millis() - uplinks[i].queued;
+      queue_stats.sent++;
+      queue_stats.total_wait_ms += wait;
+      if (wait > queue_stats.max_wait_ms) {
+        queue_stats.max_wait_ms = wait;
+      }
+      if (uplinks[i].confirmed) {
+        delivery_stats.delivered++;
+        delivery_stats.attempts[Min(uplinks[i].attempts, (uint8_t)LORA_HISTOGRAM) - 1]++;
+        uint8_t bucket = 0;
+        for (uint32_t s = wait / 1000; s && bucket < LORA_HISTOGRAM - 1; s >>= 1) {
+          bucket++;
+        }
+        delivery_stats.latency[bucket]++;
+      }
+    }
+    uplink_head = (uplink_head + 1) % LORA_UPLINK_QUEUE;
+    return --queue_stats.depth;
+  }
+#endif
+
+  // Milliseconds before the band is free for the next uplink, 0 if it is now
+  unsigned long nextTransmit() {
+    // elapsed time rather than a deadline, so that millis() wrapping around
+    // is harmless; cleared once over so that a stale start can't match again
+    uint32_t elapsed = (uint32_t)millis() - band_start;
+    if (elapsed >= band_silence) {
+      band_silence = 0;
+      return 0;
+    }
+    return band_silence - elapsed;
+  }
+
+#if LORA_UPLINK_QUEUE
+  // Discards the queued frames, and the fragments of a message not queued yet
+  void clearQueue() {
+    queue_stats.depth = 0;
+    frag_buf = NULL;
+  }
+
+  const LoRaQueueStats& queueStats() {
+    return queue_stats;
+  }
+
+  /*
+   * Retry policy of the uplink queue. Confirmed frames are retried on the
+   * errors set in mask (bit n for the -n returned by endPacket()),
+   * unconfirmed ones only on +ERR_BUSY, up to attempts tries in total. The
+   * wait before a retry starts at backoff ms once the band is free again,
+   * and doubles with every attempt.
+   */
+  void setRetryPolicy(uint8_t attempts, uint32_t backoff = LORA_UPLINK_RETRY, uint16_t mask = LORA_RETRY_DEFAULT) {
+    retry_attempts = attempts ? attempts : 1;
+    retry_backoff = backoff;
+    retry_mask = mask;
+  }
+
+  const LoRaDeliveryStats& deliveryStats() {
+    return delivery_stats;
+  }
+
+  void resetDeliveryStats() {
+    memset(&delivery_stats, 0, sizeof(delivery_stats));
+  }
+#endif
+
+  /*
+   * Fire-and-forget unconfirmed uplink: the command and the payload are
+   * handed to the UART back to back and the call returns a handle right
+   * away. The outcome is reported by process(), like for
+   * sendCommandAsync(): 1 for +OK, 2 to 8 for the errors endPacket()
+   * returns as -2 to -8, -1 on timeout.
+   * Nothing is asked to the module before +UTX: the payload is checked
+   * against the maximum size last read, and the call returns 0, sending
+   * nothing, if it is too long.
+   */
+  uint8_t sendAsync(const void* buff, size_t len, LoRaCommandCallback callback = NULL) {
+    if (!modemSendHeaderAsync(len)) {
+      return 0;
+    }
+    txStream().write((const uint8_t*)buff, len);
+    return modemSendResultAsync(callback);
+  }
+
+  // Same as sendAsync(), for the packet written since beginPacket()
+  uint8_t endPacketAsync(LoRaCommandCallback callback = NULL) {
+    size_t len = tx.size();
+    if (!modemSendHeaderAsync(len)) {
+      tx.clear();
+      return 0;
+    }
+    uint8_t* p;
+    size_t n;
+    while ((n = tx.peekContiguous(&p)) > 0) {
+      txStream().write(p, n);
+      tx.consume(n);
+    }
+    return modemSendResultAsync(callback);
+  }
+
+  size_t write(uint8_t c) {
+    return tx.put(c);
+  };
+
+  size_t write(const uint8_t *buffer, size_t size) {
+    return tx.put(buffer, size);
+  };
+
+  template <typename T> inline size_t write(T val) {return write((uint8_t*)&val, sizeof(T));};
+  using Print::write;
+
+  int parsePacket() {
+    return available();
+  }
+
+  // Bytes left in the current downlink, getDownlinkPort() is its port
+  virtual int available() {
+    idle();
+    if (!msg_left && !nextMessage()) {
+      maintain();
+      nextMessage();
+    }
+    return msg_left;
+  }
+
+  /*
+   * Reads up to size bytes of the current downlink, never past its end.
+   * When none is queued, waits up to the Stream timeout (see setTimeout())
+   * for the next one.
+   */
+  virtual int read(uint8_t *buf, size_t size) {
+    idle();
+    unsigned long startMillis = millis();
+    while (!msg_left && !nextMessage()) {
+      if (rx.size()) {
+        // an empty downlink is next, left for readMessage()
+        return 0;
       }
-      // TODO: Read directly into user buffer?
+      // nothing queued: a downlink parsed now lands in buf directly
+      direct_buf = buf;
+      direct_len = size;
       maintain();
-      /*
-      if (buf_available > 0) {
-        modemRead(rx.free());
-      } else {
-        break;
+      size_t cnt = size - direct_len;
+      direct_buf = NULL;
+      direct_len = 0;
+      if (cnt) {
+        return cnt;
       }
-      */
+      if (millis() - startMillis >= _timeout) {
+        return 0;
+      }
+      idle();
     }
+    size_t cnt = rx.get(buf, Min(size, msg_left));
+    msg_left -= cnt;
     return cnt;
   }
 
+  /**
+   * @brief pop a whole downlink
+   *
+   * @param buf buffer receiving the payload, cut to size
+   * @param size size of buf
+   * @param port if not NULL, receives the port of the downlink
+   * @param timestamp if not NULL, receives the millis() at its reception
+   * @return int the length of the downlink (the rest of it if read() already
+   *             took some bytes), -1 if none is queued
+   */
+  int readMessage(uint8_t* buf, size_t size, uint8_t* port = NULL, unsigned long* timestamp = NULL) {
+    if (!msg_left && !nextMessage(true)) {
+      maintain();
+      if (!nextMessage(true)) {
+        return -1;
+      }
+    }
+    size_t len = msg_left;
+    size_t n = rx.get(buf, Min(size, len));
+    rx.consume(len - n);
+    msg_left = 0;
+    if (port) *port = downlinkPort;
+    if (timestamp) *timestamp = msg_time;
+    return len;
+  }
+
+  const LoRaDownlinkStats& downlinkStats() {
+    return downlink_stats;
+  }
+
   virtual int read() {
     uint8_t c;
     if (read(&c, 1) == 1) {
@@ -405,12 +1472,30 @@ public:
 
   virtual int peek() {
     uint8_t c;
-    if (rx.peek(&c) == true) {
+    if ((msg_left || nextMessage()) && msg_left && rx.peek(&c) == true) {
       return c;
     }
     return -1;
   }
 
+  // Zero copy access to the current downlink: *p points to the next n
+  // contiguous bytes, release them with consume(n)
+  size_t peekContiguous(const uint8_t** p) {
+    if (!msg_left && !nextMessage()) {
+      return 0;
+    }
+    uint8_t* q;
+    size_t n = rx.peekContiguous(&q);
+    *p = q;
+    return Min(n, msg_left);
+  }
+
+  void consume(size_t n) {
+    n = Min(n, msg_left);
+    rx.consume(n);
+    msg_left -= n;
+  }
+
   virtual void flush() { stream.flush(); }
 
   virtual uint8_t connected() {
@@ -453,6 +1538,8 @@ public:
     if (!autoBaud()) {
       return false;
     }
+    // the module may have been reset behind our back
+    invalidateCache();
     // populate version field on startup
     version();
     if (!isLatestFW()) {
@@ -471,6 +1558,7 @@ public:
 
   bool configureBand(_lora_band band) {
     sendAT(GF("+BAND="), band);
+    invalidateCache(LORA_CACHE_ALL & ~LORA_CACHE_VERSION);
     if (waitResponse() != 1) {
         return false;
     }
@@ -504,27 +1592,32 @@ public:
   }
 
   String getChannelMask() {
-    int size = 4*getChannelMaskSize(region);
-    sendAT(GF("+CHANMASK?"));
-    if (waitResponse("+OK=") == 1) {
-        channel_mask_str = stream.readStringUntil('\r');
-        DBG("Full channel mask string: ", channel_mask_str);
-        sscanf(channel_mask_str.c_str(), "%04hx%04hx%04hx%04hx%04hx%04hx", &channelsMask[0], &channelsMask[1], &channelsMask[2],
-                                                    &channelsMask[3], &channelsMask[4], &channelsMask[5]);
-
-        return channel_mask_str.substring(0, size);
+    int size = getChannelMaskSize(region);
+    if (readChannelMask()) {
+        for (int i = 0; i < size; i++) {
+            sprintf(&line[i * 4], "%04x", channelsMask[i]);
+        }
+        return line;
     }
     String str = "0";
     return str;
   }
 
+  // Allocation free variant, fills mask with the six 16 bit words of the channel mask
+  bool getChannelMask(uint16_t mask[6]) {
+    if (!readChannelMask()) {
+      return false;
+    }
+    memcpy(mask, channelsMask, sizeof(channelsMask));
+    return true;
+  }
+
   int isChannelEnabled(int pos) {
     //Populate channelsMask array
     int max_retry = 3;
     int retry = 0;
     while (retry < max_retry) {
-      String mask = getChannelMask();
-      if (mask != "0") {
+      if (readChannelMask()) {
         break;
       }
       retry++;
@@ -544,8 +1637,7 @@ public:
     int max_retry = 3;
     int retry = 0;
     while (retry < max_retry) {
-      String mask = getChannelMask();
-      if (mask != "0") {
+      if (readChannelMask()) {
         break;
       }
       retry++;
@@ -565,8 +1657,7 @@ public:
     int max_retry = 3;
     int retry = 0;
     while (retry < max_retry) {
-      String mask = getChannelMask();
-      if (mask != "0") {
+      if (readChannelMask()) {
         break;
       }
       retry++;
@@ -581,23 +1672,54 @@ public:
     return sendMask();
   }
 
+  // Loads mask with the current channel mask, from the cache when possible
+  bool getChannelMask(LoRaChannelMask& mask) {
+    if (!readChannelMask()) {
+      return false;
+    }
+    memcpy(mask._words, channelsMask, sizeof(channelsMask));
+    mask._dirty = false;
+    return true;
+  }
+
+  // Writes mask to the modem, with a single command and only if it changed
+  bool commitChannelMask(LoRaChannelMask& mask) {
+    if (!mask._dirty) {
+      return true;
+    }
+    memcpy(channelsMask, mask._words, sizeof(channelsMask));
+    if (!sendMask()) {
+      return false;
+    }
+    mask._dirty = false;
+    return true;
+  }
+
   bool sendMask() {
-    String newMask;
+    char newMask[6 * 4 + 1];
 
     /* Convert channel mask into string */
     for (int i = 0; i < 6; i++) {
-      char hex[4];
-      sprintf(hex, "%04x", channelsMask[i]);
-      newMask.concat(hex);
+      sprintf(&newMask[i * 4], "%04x", channelsMask[i]);
     }
 
     DBG("Newmask: ", newMask);
 
-    return sendMask(newMask);
+    if (!sendMask(newMask)) {
+      return false;
+    }
+    // write-through: channelsMask is what the modem holds now
+    cache_valid |= LORA_CACHE_CHANMASK;
+    return true;
   }
 
   bool sendMask(String newMask) {
+    return sendMask(newMask.c_str());
+  }
+
+  bool sendMask(const char* newMask) {
     sendAT(GF("+CHANMASK="), newMask);
+    invalidateCache(LORA_CACHE_CHANMASK);
     if (waitResponse() != 1) {
         return false;
     }
@@ -607,6 +1729,8 @@ public:
 
   void setBaud(unsigned long baud) {
     sendAT(GF("+UART="), baud);
+    // answered at the new rate, if at all: nothing to wait for
+    closeCall();
   }
 
   bool autoBaud(unsigned long timeout = 10000L) {
@@ -622,31 +1746,236 @@ public:
   }
 
   String version() {
-    sendAT(GF("+DEV?"));
-    if (waitResponse("+OK=") == 1) {
-        fw_version = stream.readStringUntil('\r');
-    }
-    sendAT(GF("+VER?"));
-    if (waitResponse("+OK=") == 1) {
-        fw_version += " " + stream.readStringUntil('\r');
-    }
-
+    readVersion();
     return fw_version;
   }
 
+  size_t version(char* buf, size_t size) {
+    readVersion();
+    return copyString(buf, size, fw_version);
+  }
+
   String deviceEUI() {
-    String eui;
-    sendAT(GF("+DEVEUI?"));
-    if (waitResponse("+OK=") == 1) {
-        eui = stream.readStringUntil('\r');
-    }
-    return eui;
+    query(GF("+DEVEUI?"));
+    return line;
+  }
+
+  size_t deviceEUI(char* buf, size_t size) {
+    return query(GF("+DEVEUI?"), buf, size);
   }
 
+  // Parses whatever the modem sent so far, without waiting
   void maintain() {
+    if (async_pending) {
+      process();
+      return;
+    }
+    ConstStr keys[8] = { GFP(LORA_OK), GFP(LORA_ERROR) };
+    armMatcher(keys);
     while (stream.available()) {
-      waitResponse(100);
+      pollResponse();
     }
+    // downlinks queued before the handler was registered
+    deliverQueued();
+  }
+
+  /*
+   * Asynchronous commands: the command is written right away and the call
+   * returns a handle (never 0); the response is collected by process(), to
+   * be called from loop(). Completion is reported to the callback, if any,
+   * and by commandStatus(). Only one command is in flight: any other modem
+   * call first waits for it to complete.
+   */
+  template<typename... Args>
+  uint8_t sendCommandAsync(uint32_t timeout, LoRaCommandCallback callback, Args... cmd) {
+    sendAT(cmd...);
+    invalidateCache(LORA_CACHE_ALL & ~LORA_CACHE_VERSION);
+    return startAsync(timeout, callback);
+  }
+
+  uint8_t sendCommandAsync(const char* cmd, LoRaCommandCallback callback = NULL) {
+    return sendCommandAsync(1000L, callback, cmd);
+  }
+
+  // Returns 0, without joining, if the module did not take the keys
+  uint8_t joinOTAAAsync(const char *appEui, const char *appKey, const char *devEui = NULL,
+                        uint32_t timeout = DEFAULT_JOIN_TIMEOUT, LoRaCommandCallback callback = NULL) {
+    clearDownlinks();
+    network_joined = false;
+    if (!configureOTAA(appEui, appKey, devEui)) {
+      return 0;
+    }
+    invalidateCache(LORA_CACHE_ALL & ~LORA_CACHE_VERSION);
+    sendAT(GF("+JOIN"));
+    sendAT();
+    uint8_t handle = startAsync(timeout, callback, "+EVENT=1,1");
+    async_join = true;
+    return handle;
+  }
+
+  /**
+   * @brief send a list of commands without waiting for each response
+   *
+   * Commands are streamed back to back, keeping at most LORA_PIPELINE_WINDOW
+   * bytes ahead of the responses, which are then matched in order.
+   *
+   * @param batch the commands, their status is stored back into it
+   * @param timeout the time in milliseconds to wait for each response
+   * @return int the number of commands answered with "+OK"
+   */
+  int sendBatch(LoRaCommandBatch& batch, uint32_t timeout = 1000L) {
+    finishAsync();
+#if defined(LORA_STATS)
+    stats_family = LORA_CMD_BATCH;
+#endif
+    openCall();
+    // arbitrary setters, the cached values can't be trusted anymore
+    invalidateCache(LORA_CACHE_ALL & ~LORA_CACHE_VERSION);
+    ConstStr keys[8] = { GFP(LORA_OK), GFP(LORA_ERROR), GFP(LORA_ERROR_PARAM), GFP(LORA_ERROR_BUSY),
+                         GFP(LORA_ERROR_OVERFLOW), GFP(LORA_ERROR_NO_NETWORK), GFP(LORA_ERROR_RX), GFP(LORA_ERROR_UNKNOWN) };
+    armMatcher(keys);
+    matcher.reset();
+    unhandled = 0;
+    int sent = 0;
+    int done = 0;
+    int ok = 0;
+    unsigned long startMillis = millis();
+    while (done < batch._count) {
+      while (sent < batch._count &&
+             (sent == done || batch._end[sent] - batch.start(done) <= LORA_PIPELINE_WINDOW)) {
+        txStream().write((const uint8_t*)&batch._buf[batch.start(sent)], batch._end[sent] - batch.start(sent));
+        sent++;
+      }
+      int8_t index = pollResponse();
+      if (index) {
+        batch._status[done++] = index;
+        if (index == 1) ok++;
+        startMillis = millis();
+        continue;
+      }
+      if (millis() - startMillis >= timeout) {
+        while (done < batch._count) {
+          batch._status[done++] = LORA_ASYNC_TIMEOUT;
+        }
+        break;
+      }
+      idle();
+    }
+    closeCall();
+    for (int i = 0; i < batch._count; i++) {
+      statsResult(batch._status[i]);
+    }
+    DBG("### AT batch:", ok, "/", batch._count);
+    return ok;
+  }
+
+  // Drives the pending command, returns true while one is in flight
+  bool process() {
+    if (!async_pending) {
+      return false;
+    }
+    int8_t index = pollResponse();
+    if (index || millis() - async_start >= async_timeout) {
+      completeAsync(index ? index : LORA_ASYNC_TIMEOUT);
+    }
+    return async_pending;
+  }
+
+  int8_t commandStatus(uint8_t handle) {
+    if (handle == 0) {
+      return LORA_ASYNC_UNKNOWN;
+    }
+    if (async_pending && handle == async_handle) {
+      return LORA_ASYNC_PENDING;
+    }
+    for (int i = 0; i < LORA_ASYNC_HISTORY; i++) {
+      if (async_done[i].handle == handle) {
+        return async_done[i].result;
+      }
+    }
+    return LORA_ASYNC_UNKNOWN;
+  }
+
+  bool busy() {
+    return async_pending;
+  }
+
+  /*
+   * Selects what the library does while it waits for the module.
+   * LORA_WAIT_CALLBACK calls callback, e.g. to service a watchdog or sample
+   * sensors; it should return quickly.
+   */
+  void setWaitStrategy(_lora_wait mode, void (*callback)(void) = NULL) {
+    wait_mode = mode;
+    wait_callback = callback;
+  }
+
+  const LoRaWaitStats& waitStats() {
+    return wait_stats;
+  }
+
+  void resetWaitStats() {
+    memset(&wait_stats, 0, sizeof(wait_stats));
+  }
+
+  /*
+   * Per command family counters, only collected when LORA_STATS is defined
+   * before including MKRWAN.h; otherwise the snapshot stays zeroed.
+   */
+  void statsSnapshot(LoRaStatsSnapshot& out) {
+#if defined(LORA_STATS)
+    out = stats;
+    for (int i = 0; i < LORA_CMD_FAMILIES; i++) {
+      LoRaCommandStats& f = out.family[i];
+      if (!f.count) {
+        continue;
+      }
+      f.avg_us = f.total_us / f.count;
+      uint32_t rank = f.count - f.count / 100;
+      uint32_t seen = 0;
+      for (int b = 0; b < LORA_STATS_BUCKETS; b++) {
+        seen += f.histogram[b];
+        if (seen >= rank) {
+          f.p99_us = (b == LORA_STATS_BUCKETS - 1) ? f.max_us : Min((uint32_t)1000 << b, f.max_us);
+          break;
+        }
+      }
+    }
+#else
+    memset(&out, 0, sizeof(out));
+#endif
+  }
+
+  void resetStats() {
+#if defined(LORA_STATS)
+    memset(&stats, 0, sizeof(stats));
+    for (int i = 0; i < LORA_CMD_FAMILIES; i++) {
+      stats.family[i].min_us = 0xFFFFFFFF;
+    }
+    stats_family = LORA_CMD_OTHER;
+#endif
+  }
+
+  /*
+   * Writes the recorded UART traffic, oldest first, in the LoRaTrace.h
+   * format; it can be played back with LoRaTraceReplay. Only recorded when
+   * LORA_TRACE is defined before including MKRWAN.h, otherwise writes
+   * nothing. Returns the number of bytes written.
+   */
+#if defined(LORA_TRACE)
+  size_t dumpTrace(Print& out) {
+    return trace.dump(out);
+  }
+#else
+  size_t dumpTrace(Print&) {
+    return 0;
+  }
+#endif
+
+  void clearTrace() {
+#if defined(LORA_TRACE)
+    trace.clear();
+#endif
   }
 
   void minPollInterval(unsigned long secs) {
@@ -663,9 +1992,25 @@ public:
 
   bool factoryDefault() {
     sendAT(GF("+FACNEW"));  // Factory
+    invalidateCache(LORA_CACHE_ALL & ~LORA_CACHE_VERSION);
     return waitResponse() == 1;
   }
 
+  /*
+   * Parameter cache: the getters of the values below answer from RAM once
+   * read or set, saving the AT round-trip. Values the network can change are
+   * dropped on join, after uplinks when ADR is enabled and when a downlink
+   * is received (it may carry MAC commands). Call invalidateCache() after
+   * changing them through any other mean.
+   */
+  void invalidateCache(uint8_t which = LORA_CACHE_ALL) {
+    cache_valid &= ~which;
+  }
+
+  const LoRaCacheStats& cacheStats() {
+    return cache_stats;
+  }
+
   /*
    * Power functions
    */
@@ -675,6 +2020,7 @@ public:
       return false;
     }
     sendAT(GF("+REBOOT"));
+    invalidateCache();
     if (waitResponse(10000L, "+EVENT=0,0") != 1) {
       return false;
     }
@@ -687,7 +2033,7 @@ public:
     if (waitResponse() != 1) {
       return false;
     } else {
-        String resp = stream.readStringUntil('\r');
+        streamSkipUntil('\r');
     }
     return true;
   }
@@ -716,47 +2062,43 @@ public:
 #endif
 
   bool dutyCycle(bool on) {
-    sendAT(GF("+DUTYCYCLE="), on);
-    if (waitResponse() != 1) {
+    if (!setParam(LORA_PARAM_DUTYCYCLE, on)) {
       return false;
     }
+    duty_enabled = on;
     return true;
   }
 
   bool setPort(uint8_t port) {
-    sendAT(GF("+PORT="), port);
-    if (waitResponse() != 1) {
-      return false;
-    }
-    return true;
+    return setParam(LORA_PARAM_PORT, port);
   }
 
   uint8_t getDownlinkPort(){
     return downlinkPort;
   }
 
+  /*
+   * Registers a handler called as soon as a downlink has been parsed, from
+   * within whatever call is reading the modem (maintain() is the cheapest one
+   * to run from loop()). Delivered downlinks do not go through available()
+   * and read(); those already queued are delivered first, in order. The
+   * handler must not issue modem commands.
+   * Pass NULL to go back to polling.
+   */
+  void onReceive(LoRaReceiveCallback handler) {
+    receiveCallback = handler;
+  }
+
   bool publicNetwork(bool publicNetwork) {
-    sendAT(GF("+NWK="), publicNetwork);
-    if (waitResponse() != 1) {
-      return false;
-    }
-    return true;
+    return setParam(LORA_PARAM_NWK, publicNetwork);
   }
 
   bool sleep(bool on = true) {
-    sendAT(GF("+SLEEP="), on);
-    if (waitResponse() != 1) {
-      return false;
-    }
-    return true;
+    return setParam(LORA_PARAM_SLEEP, on);
   }
 
   bool format(bool hexMode) {
-    sendAT(GF("+DFORMAT="), hexMode);
-    if (waitResponse() != 1) {
-      return false;
-    }
-    return true;
+    return setParam(LORA_PARAM_DFORMAT, hexMode);
   }
 
 /*
@@ -770,190 +2112,259 @@ public:
 	6 	LoRa 	7 	250 	11'000
 */
 
-  bool dataRate(uint8_t dr) {
-    sendAT(GF("+DR="), dr);
-    if (waitResponse() != 1) {
-      return false;
+  /*
+   * Time on air in ms of an uplink carrying len bytes of application payload
+   * (13 bytes of LoRaWAN header and MIC are added), with the modulation of
+   * the data rate in the given region: explicit header, CRC, coding rate
+   * 4/5 and 8 preamble symbols, as in Semtech AN1200.13.
+   * Returns 0 for a data rate the region does not define.
+   */
+  static uint32_t timeOnAir(_lora_band band, uint8_t dr, size_t len) {
+    uint8_t sf;
+    uint16_t bw;
+    if (!dataRateModulation(band, dr, sf, bw)) {
+      return 0;
     }
-    return true;
-  }
-
-  int getDataRate() {
-    int dr = -1;
-    sendAT(GF("+DR?"));
-    if (waitResponse("+OK=") == 1) {
-        dr = stream.readStringUntil('\r').toInt();
+    uint32_t pl = len + 13;
+    if (!sf) {
+      // FSK 50 kbit/s: 5 bytes of preamble, 3 of sync word, length and CRC
+      return ((pl + 11) * 8 + 49) / 50;
     }
-    return dr;
+    uint32_t tsym = (1000UL << sf) / bw;    // us
+    int32_t lowRate = tsym >= 16000;        // low data rate optimization
+    int32_t bits = 8 * (int32_t)pl - 4 * sf + 28 + 16;
+    int32_t chunk = 4 * (sf - 2 * lowRate);
+    uint32_t symbols = 8 + (bits > 0 ? (bits + chunk - 1) / chunk * 5 : 0);
+    // 8 preamble symbols + 4.25 of sync
+    return ((8 * 4 + 17) * tsym / 4 + symbols * tsym + 999) / 1000;
   }
 
-  bool setADR(bool adr) {
-    sendAT(GF("+ADR="), adr);
-    if (waitResponse() != 1) {
-      return false;
-    }
-    return true;
+  // Same, at the data rate in use (DR0 if it cannot be read)
+  uint32_t timeOnAir(size_t len) {
+    int dr = getDataRate();
+    return timeOnAir(region, dr < 0 ? 0 : dr, len);
   }
 
-  int getADR() {
-    int adr = -1;
-    sendAT(GF("+ADR?"));
-    if (waitResponse("+OK=") == 1) {
-        adr = stream.readStringUntil('\r').toInt();
+  // Airtime in ms left to the current hour under the regional duty cycle,
+  // 0xFFFFFFFF when the region or the module does not enforce one
+  uint32_t airtimeBudget() {
+    uint8_t divisor = dutyCycleDivisor(region);
+    if (!divisor || !duty_enabled) {
+      return 0xFFFFFFFF;
     }
-    return adr;
+    uint32_t budget = 3600000UL / divisor;
+    if (millis() - duty_window >= 3600000UL) {
+      return budget;
+    }
+    return duty_used < budget ? budget - duty_used : 0;
   }
 
-  String getDevAddr() {
-    String devaddr = "";
-    sendAT(GF("+DEVADDR?"));
-    if (waitResponse("+OK=") == 1) {
-        devaddr = stream.readStringUntil('\r');
+  // Uplinks of len bytes that fit in an hour at the current data rate
+  uint32_t maxMessagesPerHour(size_t len) {
+    uint32_t toa = timeOnAir(len);
+    if (!toa) {
+      return 0;
     }
-    return devaddr;
+    uint8_t divisor = duty_enabled ? dutyCycleDivisor(region) : 0;
+    return 3600000UL / (toa * (divisor ? divisor : 1));
   }
 
-  String getNwkSKey() {
-    String nwkskey = "";
-    sendAT(GF("+NWKSKEY?"));
-    if (waitResponse("+OK=") == 1) {
-        nwkskey = stream.readStringUntil('\r');
-    }
-    return nwkskey;
+  bool dataRate(uint8_t dr) {
+    return setParam(LORA_PARAM_DR, dr);
   }
 
-  String getAppSKey() {
-    String appskey = "";
-    sendAT(GF("+APPSKEY?"));
-    if (waitResponse("+OK=") == 1) {
-        appskey = stream.readStringUntil('\r');
-    }
-    return appskey;
+  int getDataRate() {
+    uint32_t dr;
+    return getParam(LORA_PARAM_DR, dr) ? (int)dr : -1;
   }
 
-  int getRX2DR() {
-    int dr = -1;
-    sendAT(GF("+RX2DR?"));
-    if (waitResponse("+OK=") == 1) {
-        dr = stream.readStringUntil('\r').toInt();
-    }
-    return dr;
+  bool setADR(bool adr) {
+    return setParam(LORA_PARAM_ADR, adr);
+  }
+
+  int getADR() {
+    uint32_t adr;
+    return getParam(LORA_PARAM_ADR, adr) ? (int)adr : -1;
+  }
+
+  String getDevAddr() {
+    readDevAddr();
+    return cache_devaddr;
+  }
+
+  size_t getDevAddr(char* buf, size_t size) {
+    readDevAddr();
+    return copyString(buf, size, cache_devaddr);
+  }
+
+  String getNwkSKey() {
+    query(GF("+NWKSKEY?"));
+    return line;
+  }
+
+  size_t getNwkSKey(char* buf, size_t size) {
+    return query(GF("+NWKSKEY?"), buf, size);
+  }
+
+  String getAppSKey() {
+    query(GF("+APPSKEY?"));
+    return line;
+  }
+
+  size_t getAppSKey(char* buf, size_t size) {
+    return query(GF("+APPSKEY?"), buf, size);
+  }
+
+  int getRX2DR() {
+    uint32_t dr;
+    return getParam(LORA_PARAM_RX2DR, dr) ? (int)dr : -1;
   }
 
   bool setRX2DR(uint8_t dr) {
-    sendAT(GF("+RX2DR="),dr);
-    if (waitResponse() != 1) {
-      return false;
-    }
-    return true;
+    return setParam(LORA_PARAM_RX2DR, dr);
   }
 
   uint32_t getRX2Freq() {
-    int freq = -1;
-    sendAT(GF("+RX2FQ?"));
-    if (waitResponse("+OK=") == 1) {
-        freq = stream.readStringUntil('\r').toInt();
-    }
-    return freq;
+    uint32_t freq;
+    return getParam(LORA_PARAM_RX2FQ, freq) ? freq : (uint32_t)-1;
   }
 
   bool setRX2Freq(uint32_t freq) {
-    sendAT(GF("+RX2FQ="),freq);
-    if (waitResponse() != 1) {
-      return false;
-    }
-    return true;
+    return setParam(LORA_PARAM_RX2FQ, freq);
   }
 
   bool setFCU(uint16_t fcu) {
-    sendAT(GF("+FCU="), fcu);
-    if (waitResponse() != 1) {
-      return false;
-    }
-    return true;
+    return setParam(LORA_PARAM_FCU, fcu);
   }
 
   int32_t getFCU() {
-    int32_t fcu = -1;
-    sendAT(GF("+FCU?"));
-    if (waitResponse("+OK=") == 1) {
-        fcu = stream.readStringUntil('\r').toInt();
-    }
-    return fcu;
+    uint32_t fcu;
+    return getParam(LORA_PARAM_FCU, fcu) ? (int32_t)fcu : -1;
   }
 
   bool setFCD(uint16_t fcd) {
-    sendAT(GF("+FCD="), fcd);
-    if (waitResponse() != 1) {
-      return false;
-    }
-    return true;
+    return setParam(LORA_PARAM_FCD, fcd);
   }
 
   int32_t getFCD() {
-    int32_t fcd = -1;
-    sendAT(GF("+FCD?"));
-    if (waitResponse("+OK=") == 1) {
-        fcd = stream.readStringUntil('\r').toInt();
-    }
-    return fcd;
+    uint32_t fcd;
+    return getParam(LORA_PARAM_FCD, fcd) ? (int32_t)fcd : -1;
   }
 
 
 private:
 
   bool isArduinoFW() {
-    return (fw_version.indexOf(ARDUINO_FW_IDENTIFIER) >= 0);
+    return (strstr(fw_version, ARDUINO_FW_IDENTIFIER) != NULL);
   }
 
   bool isLatestFW() {
-    return (fw_version == ARDUINO_FW_VERSION);
+    return (strcmp(fw_version, ARDUINO_FW_VERSION) == 0);
   }
 
-  bool changeMode(_lora_mode mode) {
-    sendAT(GF("+MODE="), mode);
-    if (waitResponse() != 1) {
-      return false;
+  bool cached(uint8_t which) {
+    if (cache_valid & which) {
+      cache_stats.hits++;
+      return true;
     }
-    return true;
+    cache_stats.misses++;
+    return false;
   }
 
-  bool join(uint32_t timeout) {
-    sendAT(GF("+JOIN"));
-    sendAT();
-    if (waitResponse(timeout, "+EVENT=1,1") != 1) {
-      return false;
+  void readVersion() {
+    if (cached(LORA_CACHE_VERSION)) {
+        return;
+    }
+    size_t len = strlen(fw_version);
+    if (query(GF("+DEV?"))) {
+        len = copyString(fw_version, sizeof(fw_version), line);
+    }
+    if (query(GF("+VER?")) && len + 1 < sizeof(fw_version)) {
+        fw_version[len++] = ' ';
+        copyString(&fw_version[len], sizeof(fw_version) - len, line);
+        cache_valid |= LORA_CACHE_VERSION;
+    }
+  }
+
+  void readDevAddr() {
+    if (cached(LORA_CACHE_DEVADDR)) {
+        return;
+    }
+    if (query(GF("+DEVADDR?"), cache_devaddr, sizeof(cache_devaddr))) {
+        cache_valid |= LORA_CACHE_DEVADDR;
     }
-    return true;
   }
 
-  bool set(_lora_property prop, const char* value) {
-    switch (prop) {
-        case APP_EUI:
-            sendAT(GF("+APPEUI="), value);
-            break;
-        case APP_KEY:
-            sendAT(GF("+APPKEY="), value);
-            break;
-        case DEV_EUI:
-            sendAT(GF("+DEVEUI="), value);
-            break;
-        case DEV_ADDR:
-            sendAT(GF("+DEVADDR="), value);
-            break;
-        case NWKS_KEY:
-            sendAT(GF("+NWKSKEY="), value);
-            break;
-        case NWK_ID:
-            sendAT(GF("+IDNWK="), value);
-            break;
-        case APPS_KEY:
-            sendAT(GF("+APPSKEY="), value);
-            break;
-        default:
+  bool readChannelMask() {
+    if (cached(LORA_CACHE_CHANMASK)) {
+        return true;
+    }
+    sendAT(GF("+CHANMASK?"));
+    if (waitResponse("+OK=") != 1) {
+        return false;
+    }
+    // 24 hex digits, four per word; a short reply leaves the rest cleared
+    int n = 4;
+    for (int i = 0; i < 6; i++) {
+        uint32_t word = 0;
+        if (n == 4 && (n = streamReadNumber(word, 16, '\r', 4)) < 0) {
             return false;
+        }
+        channelsMask[i] = (uint16_t)word;
     }
-    if (waitResponse() != 1) {
+    if (n == 4) {
+        streamSkipUntil('\r');
+    }
+    cache_valid |= LORA_CACHE_CHANMASK;
+    return true;
+  }
+
+  bool configureOTAA(const char *appEui, const char *appKey, const char *devEui) {
+    LoRaCommandBatch batch;
+    batch.add(GF("+MODE="), OTAA);
+    batch.add(GF("+APPEUI="), appEui);
+    batch.add(GF("+APPKEY="), appKey);
+    if (devEui != NULL) {
+        batch.add(GF("+DEVEUI="), devEui);
+    }
+    return sendBatchChecked(batch);
+  }
+
+  /*
+   * sendBatch(), then, unless every command got its +OK, all of them again
+   * one at a time: responses are matched in order, so a command the module
+   * dropped while busy with the previous one shifts the statuses of the
+   * next ones and can't be told apart. Returns true once all are answered
+   * with +OK.
+   */
+  bool sendBatchChecked(LoRaCommandBatch& batch) {
+    if (sendBatch(batch) == batch._count) {
+      return true;
+    }
+    bool ok = true;
+    for (int i = 0; i < batch._count; i++) {
+      finishAsync();
+#if defined(LORA_STATS)
+      stats_family = LORA_CMD_BATCH;
+#endif
+      openCall();
+      txStream().write((const uint8_t*)&batch._buf[batch.start(i)], batch._end[i] - batch.start(i));
+      stream.flush();
+      idle();
+      batch._status[i] = waitResponse();
+      if (batch._status[i] != 1) {
+        DBG("### Batched command", i, "failed:", batch._status[i]);
+        ok = false;
+      }
+    }
+    return ok;
+  }
+
+  bool join(uint32_t timeout) {
+    invalidateCache(LORA_CACHE_ALL & ~LORA_CACHE_VERSION);
+    sendAT(GF("+JOIN"));
+    sendAT();
+    if (waitResponse(timeout, "+EVENT=1,1") != 1) {
       return false;
     }
     return true;
@@ -984,15 +2395,41 @@ private:
         return -20;
     }
 
+    modemSendHeader(len, confirmed);
+    txStream().write((uint8_t*)buff, len);
+    return modemSendResult(len, confirmed);
+  }
+
+  // Airtime of the uplink being sent, at the data rate last read or set
+  // (DR0, the slowest, before any): the send path never queries the module
+  uint32_t uplinkAirtime(size_t len) {
+    if (!duty_enabled || !dutyCycleDivisor(region)) {
+      return 0;
+    }
+    return timeOnAir(region, (uint8_t)cache_param[LORA_PARAM_DR], len);
+  }
+
+  void modemSendHeader(size_t len, bool confirmed) {
+    tx_airtime = uplinkAirtime(len);
     if (confirmed) {
         sendAT(GF("+CTX "), len);
     } else {
         sendAT(GF("+UTX "), len);
     }
+  }
 
-    stream.write((uint8_t*)buff, len);
+  // A confirmed uplink is answered once its ack came or both receive windows
+  // passed, after the frame's airtime and the RX2 delay
+  uint32_t uplinkTimeout(size_t len, bool confirmed) {
+    if (!confirmed) {
+      return 1000L;
+    }
+    return 1000L + LORA_RX2_DELAY + timeOnAir(region, (uint8_t)cache_param[LORA_PARAM_DR], len);
+  }
 
-    int8_t rc = waitResponse( GFP(LORA_OK), GFP(LORA_ERROR), GFP(LORA_ERROR_PARAM), GFP(LORA_ERROR_BUSY), GFP(LORA_ERROR_OVERFLOW), GFP(LORA_ERROR_NO_NETWORK), GFP(LORA_ERROR_RX), GFP(LORA_ERROR_UNKNOWN) );
+  int modemSendResult(size_t len, bool confirmed) {
+    int8_t rc = waitResponse( uplinkTimeout(len, confirmed), GFP(LORA_OK), GFP(LORA_ERROR), GFP(LORA_ERROR_PARAM), GFP(LORA_ERROR_BUSY), GFP(LORA_ERROR_OVERFLOW), GFP(LORA_ERROR_NO_NETWORK), GFP(LORA_ERROR_RX), GFP(LORA_ERROR_UNKNOWN) );
+    uplinkDone(rc);
     if (rc == 1) {            ///< OK
       return len;
     } else if ( rc > 1 ) {    ///< LORA ERROR
@@ -1002,16 +2439,162 @@ private:
     }
   }
 
+  // +UTX without the flush and the pause of sendAT(): the payload written
+  // next lands in the UART buffer right behind the command
+  bool modemSendHeaderAsync(size_t len) {
+    finishAsync();
+    size_t room = knownMaxSize();
+    if (room && len > room) {
+      return false;
+    }
+    tx_airtime = uplinkAirtime(len);
+    statsCommand(GF("+UTX "), len);
+    streamWrite("AT", GF("+UTX "), len, LORA_NL);
+    DBG("### AT: +UTX ", len);
+    return true;
+  }
+
+  uint8_t modemSendResultAsync(LoRaCommandCallback callback) {
+    uint8_t handle = startAsync(1000L, callback, GFP(LORA_OK), GFP(LORA_ERROR), GFP(LORA_ERROR_PARAM), GFP(LORA_ERROR_BUSY), GFP(LORA_ERROR_OVERFLOW), GFP(LORA_ERROR_NO_NETWORK), GFP(LORA_ERROR_RX), GFP(LORA_ERROR_UNKNOWN));
+    async_uplink = true;
+    return handle;
+  }
+
+#if LORA_UPLINK_QUEUE
+  // Answer of the uplink that timed out, if it came since, 0 otherwise
+  int8_t lateUplinkResult() {
+    finishAsync();
+    ConstStr keys[8] = { GFP(LORA_OK), GFP(LORA_ERROR), GFP(LORA_ERROR_PARAM), GFP(LORA_ERROR_BUSY),
+                         GFP(LORA_ERROR_OVERFLOW), GFP(LORA_ERROR_NO_NETWORK), GFP(LORA_ERROR_RX), GFP(LORA_ERROR_UNKNOWN) };
+    armMatcher(keys);
+    matcher.reset();
+    unhandled = 0;
+    return pollResponse();
+  }
+#endif
+
+  // Bookkeeping once the modem answered an uplink, or timed out
+  void uplinkDone(int8_t rc) {
+    // with ADR on (or unknown) the network drives the data rate
+    if (!(cache_valid & LORA_CACHE_ADR) || cache_param[LORA_PARAM_ADR]) {
+      invalidateCache(LORA_CACHE_DR | LORA_CACHE_MSIZE | LORA_CACHE_CHANMASK);
+    }
+    // +ERR_RX and +ERR_UNKNOWN come after the frame went on air too, and
+    // without an answer it most likely did
+    bool sent = (rc == 1 || rc == 7 || rc == 8 || rc == LORA_ASYNC_TIMEOUT);
+    if (sent && tx_airtime) {
+      // silent for airtime * (1 / duty cycle - 1) after the frame
+      band_start = millis();
+      band_silence = tx_airtime * (dutyCycleDivisor(region) - 1);
+      if (millis() - duty_window >= 3600000UL) {
+        duty_window = millis();
+        duty_used = 0;
+      }
+      duty_used += tx_airtime;
+    }
+  }
+
+  // Spreading factor and bandwidth (kHz) of a data rate, sf is 0 for FSK
+  static bool dataRateModulation(_lora_band band, uint8_t dr, uint8_t& sf, uint16_t& bw) {
+    bw = 125;
+    switch (band) {
+      case US915:
+      case US915_HYBRID:
+      case AU915:
+        if (band != AU915 && dr <= 3) {
+          sf = 10 - dr;
+        } else if (band == AU915 && dr <= 5) {
+          sf = 12 - dr;
+        } else if (dr == (band == AU915 ? 6 : 4)) {
+          sf = 8;
+          bw = 500;
+        } else if (dr >= 8 && dr <= 13) {
+          // downlink only
+          sf = 20 - dr;
+          bw = 500;
+        } else {
+          return false;
+        }
+        return true;
+      default:
+        if (dr <= 5) {
+          sf = 12 - dr;
+        } else if (dr == 6 && (band == EU868 || band == EU433 || band == CN779 || band == AS923)) {
+          sf = 7;
+          bw = 250;
+        } else if (dr == 7 && band != CN470 && band != KR920) {
+          sf = 0;
+        } else {
+          return false;
+        }
+        return true;
+    }
+  }
+
+#if LORA_UPLINK_QUEUE
+  // Moves fragments of the pending message to the uplink queue while it has
+  // room, each sized for the data rate in use when it is queued
+  void queueFragments() {
+    while (frag_buf && queue_stats.depth < LORA_UPLINK_QUEUE) {
+      size_t room = Min(modemGetMaxSize(), (size_t)LORA_UPLINK_PAYLOAD);
+      if (room <= LORA_FRAGMENT_HEADER || frag_index >= LORA_FRAGMENT_MAX) {
+        // the message does not fit anymore
+        frag_buf = NULL;
+        queue_stats.dropped++;
+        return;
+      }
+      size_t n = Min(room - LORA_FRAGMENT_HEADER, frag_len - frag_off);
+      bool last = (frag_off + n == frag_len);
+      uint8_t frame[LORA_UPLINK_PAYLOAD];
+      frame[0] = LORA_FRAGMENT_HDR(frag_id, last, frag_index);
+      memcpy(frame + LORA_FRAGMENT_HEADER, frag_buf + frag_off, n);
+      enqueue(frame, n + LORA_FRAGMENT_HEADER, frag_confirmed);
+      frag_off += n;
+      frag_index++;
+      if (last) {
+        frag_buf = NULL;
+      }
+    }
+  }
+#endif
+
+  // Regional duty cycle limit as 1/divisor, 0 when the band has none
+  static uint8_t dutyCycleDivisor(_lora_band band) {
+    switch (band) {
+      case EU868:
+      case EU433:
+      case CN779:
+        return 100;
+      default:
+        return 0;
+    }
+  }
+
+  // Maximum payload without asking the module: the last size read, 0 if none
+  // was (the module then answers +ERR_PARAM_OVERFLOW to a frame too long)
+  size_t knownMaxSize() {
+    return isArduinoFW() ? 64 : cache_msize;
+  }
+
   size_t modemGetMaxSize() {
     if (isArduinoFW()) {
       return 64;
     }
+    if (cached(LORA_CACHE_MSIZE)) {
+      return cache_msize;
+    }
     sendAT(GF("+MSIZE?"));
     if (waitResponse(2000L) != 1) {
       return 0;
     }
     streamSkipUntil('=');
-    return stream.readStringUntil('\r').toInt();
+    uint32_t size;
+    if (streamReadNumber(size) <= 0) {
+      return 0;
+    }
+    cache_msize = size;
+    cache_valid |= LORA_CACHE_MSIZE;
+    return cache_msize;
   }
 
   size_t getJoinStatus() {
@@ -1020,46 +2603,589 @@ private:
       return 0;
     }
     streamSkipUntil('=');
-    return stream.readStringUntil('\r').toInt();
+    uint32_t status;
+    if (streamReadNumber(status) <= 0) {
+      return 0;
+    }
+    return status;
+  }
+
+  /**
+   * @brief send a query and read the value of its "+OK=<value>" reply
+   *
+   * @param cmd the AT command, without the AT prefix
+   * @param buf buffer receiving the null terminated value
+   * @param size size of buf
+   * @return size_t the length of the value, 0 if the modem replied with an error
+   */
+  size_t query(ConstStr cmd, char* buf, size_t size) {
+    sendAT(cmd);
+    if (waitResponse("+OK=") != 1) {
+      if (size) buf[0] = '\0';
+      return 0;
+    }
+    return streamReadLine(buf, size);
+  }
+
+  size_t query(ConstStr cmd) {
+    return query(cmd, line, sizeof(line));
+  }
+
+  /*
+   * Single code path behind the numeric setters and getters, driven by
+   * LORA_PARAMS: writes go through the cache, reads are served from it.
+   */
+  bool setParam(_lora_param p, uint32_t value) {
+    const LoRaParam& d = LORA_PARAMS[p];
+    sendAT(GF("+"), d.name, GF("="), value);
+    invalidateCache(d.cache | d.depends);
+    if (waitResponse() != 1) {
+      return false;
+    }
+    if (d.cache) {
+      cache_param[p] = value;
+      cache_valid |= d.cache;
+    }
+    return true;
+  }
+
+  bool getParam(_lora_param p, uint32_t& value) {
+    const LoRaParam& d = LORA_PARAMS[p];
+    if (d.cache && cached(d.cache)) {
+      value = cache_param[p];
+      return true;
+    }
+    sendAT(GF("+"), d.name, GF("?"));
+    if (waitResponse("+OK=") != 1) {
+      return false;
+    }
+    if (streamReadNumber(value) <= 0) {
+      return false;
+    }
+    if (d.cache) {
+      cache_param[p] = value;
+      cache_valid |= d.cache;
+    }
+    return true;
+  }
+
+  static size_t copyString(char* dst, size_t size, const char* src) {
+    if (!size) return 0;
+    size_t len = strlen(src);
+    if (len >= size) len = size - 1;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+    return len;
   }
 
   /* Utilities */
   template<typename T>
   void streamWrite(T last) {
-    stream.print(last);
+    txStream().print(last);
   }
 
   template<typename T, typename... Args>
   void streamWrite(T head, Args... tail) {
-    stream.print(head);
+    txStream().print(head);
     streamWrite(tail...);
   }
 
-  int streamRead() { return stream.read(); }
+  int streamRead() {
+    int c = stream.read();
+#if defined(LORA_TRACE)
+    if (c >= 0) {
+      trace.add(LORA_TRACE_RX, (uint8_t)c, micros());
+    }
+#endif
+    return c;
+  }
+
+  // Where the commands and payloads are written, through the trace if any
+  Print& txStream() {
+#if defined(LORA_TRACE)
+    return trace_tap;
+#else
+    return stream;
+#endif
+  }
+
+  // Moves a downlink payload from the UART to dst, or to the free space of rx
+  // when dst is NULL; bytes that fit nowhere are dropped, so are all of them
+  // when keep is false.
+  size_t streamReadPayload(uint8_t* dst, size_t length, bool keep = true, uint32_t timeout = 1000L) {
+    size_t cnt = 0;
+    unsigned long startMillis = millis();
+    while (cnt < length && millis() - startMillis < timeout) {
+      if (!stream.available()) {
+        idle();
+        continue;
+      }
+      uint8_t* p;
+      size_t n;
+      if (!keep) {
+        n = 0;
+      } else if (dst) {
+        p = dst + cnt;
+        n = length - cnt;
+      } else {
+        n = rx.reserveContiguous(&p);
+      }
+      if (n == 0) {
+        streamRead();
+        cnt++;
+        continue;
+      }
+      n = Min(n, Min(length - cnt, (size_t)stream.available()));
+      n = stream.readBytes(p, n);
+#if defined(LORA_TRACE)
+      trace.add(LORA_TRACE_RX, p, n, micros());
+#endif
+      if (!dst) {
+        rx.commit(n);
+      }
+      cnt += n;
+    }
+    return cnt;
+  }
+
+  // Reads up to the terminator (not stored) into buf, without allocating
+  size_t streamReadLine(char* buf, size_t size, char terminator = '\r', uint32_t timeout = 1000L) {
+    size_t len = 0;
+    unsigned long startMillis = millis();
+    while (millis() - startMillis < timeout) {
+      if (!stream.available()) {
+        idle();
+        continue;
+      }
+      int c = streamRead();
+      if (c < 0) continue;
+      if (c == terminator) break;
+      if (len + 1 < size) buf[len++] = (char)c;
+    }
+    if (size) buf[len] = '\0';
+    return len;
+  }
+
+  /*
+   * Parses an unsigned number as its digits arrive, without buffering the
+   * field. Stops after the terminator (consumed) or, when width is set,
+   * after width digits. Returns the number of digits read, or -1 on a bad
+   * digit, an overflow of value or a timeout; the rest of the field is still
+   * consumed so the next one starts in the right place.
+   */
+  int streamReadNumber(uint32_t& value, uint8_t base = 10, char terminator = '\r', uint8_t width = 0, uint32_t timeout = 1000L) {
+    int digits = 0;
+    bool ok = true;
+    value = 0;
+    unsigned long startMillis = millis();
+    while (millis() - startMillis < timeout) {
+      if (width && digits == width) {
+        return ok ? digits : -1;
+      }
+      if (!stream.available()) {
+        idle();
+        continue;
+      }
+      int c = streamRead();
+      if (c < 0) continue;
+      if (c == terminator) {
+        return ok ? digits : -1;
+      }
+      uint8_t d;
+      if (c >= '0' && c <= '9') {
+        d = c - '0';
+      } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+        d = (c | 0x20) - 'a' + 10;
+      } else {
+        d = base;
+      }
+      if (d >= base || value > (UINT32_MAX - d) / base) {
+        ok = false;
+      } else {
+        value = value * base + d;
+      }
+      digits++;
+    }
+    return -1;
+  }
 
-  bool streamSkipUntil(char c) { //TODO: timeout
-    while (true) {
-      while (!stream.available()) {}
-      if (stream.read() == c)
+  bool streamSkipUntil(char c, uint32_t timeout = 1000L) {
+    unsigned long startMillis = millis();
+    while (millis() - startMillis < timeout) {
+      while (millis() - startMillis < timeout && !stream.available()) {
+        idle();
+      }
+      if (streamRead() == c)
         return true;
     }
     return false;
   }
 
+  void idle() {
+    unsigned long start = micros();
+    switch (wait_mode) {
+      case LORA_WAIT_BUSY:
+        break;
+      case LORA_WAIT_YIELD:
+        yield();
+        break;
+      case LORA_WAIT_SLEEP:
+#if defined(__arm__)
+        __asm__ volatile ("wfi");
+#else
+        yield();
+#endif
+        break;
+      case LORA_WAIT_CALLBACK:
+        if (wait_callback) {
+          wait_callback();
+        }
+        break;
+      default:
+        YIELD();
+        break;
+    }
+    // only the waits of a command: idle_us is a part of total_us
+    if (call_open) {
+      wait_stats.idle_us += micros() - start;
+    }
+  }
+
+  void openCall() {
+    if (!call_open) {
+      call_open = true;
+      call_start = micros();
+      call_idle = wait_stats.idle_us;
+    }
+  }
+
+  void closeCall() {
+    if (!call_open) {
+      return;
+    }
+    call_open = false;
+    wait_stats.commands++;
+    wait_stats.last_us = micros() - call_start;
+    wait_stats.last_idle_us = wait_stats.idle_us - call_idle;
+    wait_stats.total_us += wait_stats.last_us;
+#if defined(LORA_STATS)
+    LoRaCommandStats& f = stats.family[stats_family];
+    uint32_t us = wait_stats.last_us;
+    f.count++;
+    f.total_us += us;
+    f.min_us = Min(f.min_us, us);
+    f.max_us = Max(f.max_us, us);
+    uint8_t b = 0;
+    for (uint32_t ms = us / 1000; ms && b < LORA_STATS_BUCKETS - 1; ms >>= 1) {
+      b++;
+    }
+    if (f.histogram[b] < 0xFFFF) {
+      f.histogram[b]++;
+    }
+#endif
+  }
+
+  // Outcome of a command of the current family, as in commandStatus()
+  void statsResult(int8_t result) {
+#if defined(LORA_STATS)
+    LoRaCommandStats& f = stats.family[stats_family];
+    if (result >= 1 && result <= 8) {
+      f.responses[result - 1]++;
+    } else if (result == LORA_ASYNC_TIMEOUT) {
+      f.timeouts++;
+    }
+#else
+    (void)result;
+#endif
+  }
+
+  // Family of the command being written: its name ends at the first value
+  // or at '=', '?' or ' '
+#if defined(LORA_STATS)
+  template<typename... Args>
+  void statsCommand(Args... cmd) {
+    char name[10];
+    uint8_t len = 0;
+    char end = statsName(name, len, cmd...);
+    name[len] = '\0';
+    statsFamily(name, end);
+  }
+#else
+  template<typename... Args>
+  void statsCommand(Args...) {
+  }
+#endif
+
+  void statsFamily(const char* name, char end) {
+#if defined(LORA_STATS)
+    for (size_t i = 0; i < sizeof(LORA_CMD_NAMES) / sizeof(LORA_CMD_NAMES[0]); i++) {
+      if (strcmp(name, LORA_CMD_NAMES[i]) == 0) {
+        stats_family = i;
+        return;
+      }
+    }
+    stats_family = (end == '=') ? LORA_CMD_SET : (end == '?') ? LORA_CMD_GET : LORA_CMD_OTHER;
+#endif
+  }
+
+  char statsName(char*, uint8_t&) {
+    return '\0';
+  }
+
+  template<typename... Args>
+  char statsName(char* name, uint8_t& len, const char* head, Args... tail) {
+    for (; *head; head++) {
+      if (*head == '=' || *head == '?' || *head == ' ') {
+        return *head;
+      }
+      if (*head != '+' && len < 9) {
+        name[len++] = *head;
+      }
+    }
+    return statsName(name, len, tail...);
+  }
+
+  template<typename T, typename... Args>
+  char statsName(char*, uint8_t&, T, Args...) {
+    return '=';
+  }
+
   template<typename... Args>
   void sendAT(Args... cmd) {
+    finishAsync();
+    if (!call_open) {
+      statsCommand(cmd...);
+    }
+    openCall();
     streamWrite("AT", cmd..., LORA_NL);
     stream.flush();
-    YIELD();
+    idle();
     DBG("### AT:", cmd...);
   }
 
-  // TODO: Optimize this!
+  // Loads the candidate responses, the automaton state is kept when they
+  // did not change so that a response split across calls is still found
+  void armMatcher(const ConstStr keys[8])
+  {
+    // most calls reuse the same response set, keep the compiled automaton
+    if (matcher_keys[0] && memcmp(keys, matcher_keys, sizeof(matcher_keys)) == 0) {
+      return;
+    }
+    memcpy(matcher_keys, keys, sizeof(matcher_keys));
+    matcher.clear();
+    for (int i = 0; i < 8; i++) {
+      if (keys[i] && !matcher.add(keys[i], i + 1)) {
+        DBG("### Matcher full, increase LORA_MATCHER_NODES");
+      }
+    }
+    matcher.add(LORA_RECV, LORA_RECV_INDEX);
+    matcher.compile();
+  }
+
+  uint8_t startAsync(uint32_t timeout, LoRaCommandCallback callback,
+                     ConstStr r1=GFP(LORA_OK), ConstStr r2=GFP(LORA_ERROR),
+                     ConstStr r3=NULL, ConstStr r4=NULL, ConstStr r5=NULL,
+                     ConstStr r6=NULL, ConstStr r7=NULL, ConstStr r8=NULL)
+  {
+    startResponse(timeout, callback, r1, r2, r3, r4, r5, r6, r7, r8);
+    if (++async_next == 0) async_next = 1;
+    async_handle = async_next;
+    return async_handle;
+  }
+
+  void startResponse(uint32_t timeout, LoRaCommandCallback callback,
+                     ConstStr r1, ConstStr r2, ConstStr r3, ConstStr r4,
+                     ConstStr r5, ConstStr r6, ConstStr r7, ConstStr r8)
+  {
+    finishAsync();
+    ConstStr keys[8] = { r1, r2, r3, r4, r5, r6, r7, r8 };
+    armMatcher(keys);
+    matcher.reset();
+    unhandled = 0;
+    openCall();
+    async_handle = 0;
+    async_pending = true;
+    async_join = false;
+    async_uplink = false;
+    async_result = LORA_ASYNC_PENDING;
+    async_start = millis();
+    async_timeout = timeout;
+    async_callback = callback;
+  }
+
+  void completeAsync(int8_t result) {
+    if (result == LORA_ASYNC_TIMEOUT && unhandled) {
+      line[unhandled] = '\0';
+      DBG("### Unhandled:", line);
+#if defined(LORA_STATS)
+      stats.unhandled_bytes += unhandled;
+#endif
+    }
+    async_pending = false;
+    async_result = result;
+    closeCall();
+    statsResult(result);
+    if (async_join) {
+      network_joined = (result == 1);
+    }
+    if (async_uplink) {
+      uplinkDone(result);
+    }
+    if (async_handle) {
+      async_done[async_handle % LORA_ASYNC_HISTORY].handle = async_handle;
+      async_done[async_handle % LORA_ASYNC_HISTORY].result = result;
+    }
+    // the callback may already submit the next command
+    if (async_callback) {
+      async_callback(async_handle, result);
+    }
+  }
+
+  void finishAsync() {
+    while (process()) {
+      idle();
+    }
+  }
+
+  /**
+   * @brief consume the bytes available from the modem, without waiting.
+   *
+   * Downlinks (+RECV=) are handled on the way.
+   *
+   * @return int8_t   n if the response = r<n> of the armed response set
+   *                  0 if no response has been matched yet
+   */
+  int8_t pollResponse()
+  {
+    while (stream.available() > 0) {
+      int a = streamRead();
+      if (a < 0) continue;
+      if (unhandled + 1 < sizeof(line)) line[unhandled++] = (char)a;
+      int8_t m = matcher.feed((char)a);
+      if (m == LORA_RECV_INDEX) {
+        unhandled = 0;
+        receiveDownlink();
+        matcher.reset();
+      } else if (m) {
+        unhandled = 0;
+        return m;
+      }
+    }
+    return 0;
+  }
+
+  void receiveDownlink()
+  {
+    // may carry MAC commands changing the radio parameters
+    invalidateCache(LORA_CACHE_DR | LORA_CACHE_MSIZE | LORA_CACHE_CHANMASK | LORA_CACHE_RX2DR | LORA_CACHE_RX2FQ);
+    uint32_t port, length;
+    if (streamReadNumber(port, 10, ',') <= 0 || streamReadNumber(length) < 0) {
+      // the header cannot be trusted, leave the payload to the matcher
+      return;
+    }
+    streamSkipUntil('\n');
+    streamSkipUntil('\n');
+    downlink_stats.received++;
+    // the handler gets the downlinks queued before this one first
+    deliverQueued();
+    bool empty = !msg_left && !rx.size();
+    if (receiveCallback && !direct_len && empty) {
+      // rx is empty: rewind it so the payload is one contiguous view
+      rx.clear();
+      if (streamReadPayload(NULL, length) < length || rx.size() < length) {
+        downlink_stats.truncated++;
+      }
+      uint8_t* p;
+      size_t n = rx.peekContiguous(&p);
+      msg_time = millis();
+      deliver(port, p, n);
+      rx.clear();
+    } else if (direct_buf && length && direct_len >= length && empty) {
+      // read() is waiting with room for all of it; an empty downlink is
+      // queued instead, so that its port is not lost
+      size_t n = streamReadPayload(direct_buf, length);
+      if (n < length) {
+        downlink_stats.truncated++;
+      }
+      direct_len -= n;
+      downlinkPort = port;
+      msg_time = millis();
+    } else if (length <= 0xFF && (size_t)rx.free() >= LORA_RECORD_HEADER + length) {
+      uint8_t hdr[LORA_RECORD_HEADER] = { (uint8_t)port, (uint8_t)length };
+      unsigned long now = millis();
+      memcpy(&hdr[2], &now, 4);
+      rx.put(hdr, sizeof(hdr));
+      size_t n = streamReadPayload(NULL, length);
+      if (n < length) {
+        // keep the records aligned
+        downlink_stats.truncated++;
+        while (n++ < length) {
+          rx.put(0);
+        }
+      }
+    } else {
+      streamReadPayload(NULL, length, false);
+      downlink_stats.dropped++;
+      DBG("### Downlink dropped, rx full");
+    }
+  }
+
+  // Passes a downlink to the receive handler, which may read the modem
+  void deliver(uint8_t port, const uint8_t* payload, size_t len) {
+    ConstStr keys[8];
+    memcpy(keys, matcher_keys, sizeof(keys));
+    downlinkPort = port;
+    receiveCallback(port, payload, len);
+    armMatcher(keys);
+  }
+
+  // Hands the queued downlinks, oldest first, to the receive handler
+  void deliverQueued() {
+    while (receiveCallback && !direct_len && (msg_left || nextMessage(true))) {
+      uint8_t* p;
+      size_t n = rx.peekContiguous(&p);
+      size_t len = msg_left;
+      msg_left = 0;
+      if (n >= len) {
+        deliver(downlinkPort, p, len);
+        rx.consume(len);
+      } else {
+        // wraps around the end of rx
+        uint8_t buf[RxN < 0xFF ? RxN : 0xFF];
+        len = rx.get(buf, len);
+        deliver(downlinkPort, buf, len);
+      }
+    }
+  }
+
+  // Makes the oldest queued downlink current. An empty one is only taken
+  // with take_empty: the byte stream calls would lose it, and its port.
+  bool nextMessage(bool take_empty = false) {
+    uint8_t hdr[LORA_RECORD_HEADER];
+    if (rx.size() < LORA_RECORD_HEADER) {
+      return false;
+    }
+    if (!take_empty && rx.peek(&hdr[1], 1) && !hdr[1]) {
+      return false;
+    }
+    rx.get(hdr, sizeof(hdr));
+    downlinkPort = hdr[0];
+    msg_left = hdr[1];
+    memcpy(&msg_time, &hdr[2], 4);
+    return true;
+  }
+
+  void clearDownlinks() {
+    rx.clear();
+    msg_left = 0;
+  }
+
   /**
    * @brief wait for a response from the modem.
-   * 
+   *
+   * This is the blocking form of an asynchronous command.
+   *
    * @param timeout the time in milliseconds to wait for a response
-   * @param data a string containing the response to wait for
    * @param r1 response string
    * @param r2 response string
    * @param r3 response string
@@ -1069,81 +3195,18 @@ private:
    * @param r7 response string
    * @param r8 response string
    * @return int8_t   n if the response = r<n>
-   *                  99 if the response ends with "+RECV="
    *                  -1 if timeout
    */
-  int8_t waitResponse(uint32_t timeout, String& data,
-                       ConstStr r1=GFP(LORA_OK), ConstStr r2=GFP(LORA_ERROR),
-                       ConstStr r3=NULL, ConstStr r4=NULL, ConstStr r5=NULL,
-                       ConstStr r6=NULL, ConstStr r7=NULL, ConstStr r8=NULL)
-  {
-    data.reserve(64);
-    int8_t index = -1;
-    int length = 0;
-    unsigned long startMillis = millis();
-    do {
-      YIELD();
-      while (stream.available() > 0) {
-        int a = streamRead();
-        if (a < 0) continue;
-        data += (char)a;
-        if (r1 && data.endsWith(r1)) {
-          index = 1;
-          goto finish;
-        } else if (r2 && data.endsWith(r2)) {
-          index = 2;
-          goto finish;
-        } else if (r3 && data.endsWith(r3)) {
-          index = 3;
-          goto finish;
-        } else if (r4 && data.endsWith(r4)) {
-          index = 4;
-          goto finish;
-        } else if (r5 && data.endsWith(r5)) {
-          index = 5;
-          goto finish;
-        } else if (r6 && data.endsWith(r6)) {
-          index = 6;
-          goto finish;
-        } else if (r7 && data.endsWith(r7)) {
-          index = 7;
-          goto finish;
-        } else if (r8 && data.endsWith(r8)) {
-          index = 8;
-          goto finish;
-        } else if (data.endsWith("+RECV=")) {
-          data = "";
-          downlinkPort = stream.readStringUntil(',').toInt();
-          length = stream.readStringUntil('\r').toInt();
-          streamSkipUntil('\n');
-          streamSkipUntil('\n');
-          for (int i = 0; i < length;) {
-            if (stream.available()) {
-                rx.put(stream.read());
-                i++;
-            }
-          }
-        }
-      }
-    } while (millis() - startMillis < timeout);
-finish:
-    if (!index) {
-      data.trim();
-      if (data.length()) {
-        DBG("### Unhandled:", data);
-      }
-      data = "";
-    }
-    return index;
-  }
-
   int8_t waitResponse(uint32_t timeout,
                        ConstStr r1=GFP(LORA_OK), ConstStr r2=GFP(LORA_ERROR),
                        ConstStr r3=NULL, ConstStr r4=NULL, ConstStr r5=NULL,
                        ConstStr r6=NULL, ConstStr r7=NULL, ConstStr r8=NULL)
   {
-    String data;
-    return waitResponse(timeout, data, r1, r2, r3, r4, r5, r6, r7, r8);
+    startResponse(timeout, NULL, r1, r2, r3, r4, r5, r6, r7, r8);
+    while (process()) {
+      idle();
+    }
+    return async_result;
   }
 
   int8_t waitResponse(ConstStr r1=GFP(LORA_OK), ConstStr r2=GFP(LORA_ERROR),
@@ -1154,3 +3217,8 @@ finish:
   }
 
 };
+
+typedef BasicLoRaModem<LORA_RX_BUFFER, LORA_TX_BUFFER> LoRaModem;
+
+// Packs fields into the packet opened by beginPacket(), see LoRaPayload.h
+typedef LoRaPayloadEncoder<LoRaModem> LoRaEncoder;